@@ -33,25 +33,56 @@
 #define RS_DIRECTION_UP     2
 #define RS_DIRECTION_DOWN   1
 
+// Packets handled in each direction by a single iterate() call
+#define SRPC_ITERATE_MAX_COUNT  8
+
+// Out queue slots that measurements leave to state changes and pings
+#define SRPC_DATA_QUEUE_RESERVE  2
+
 #ifdef ARDUINO_ARCH_ESP8266
 ETSTimer esp_timer;
 
 void esp_timer_cb(void *timer_arg) {
-    SuplaDevice.onTimer();
+    SuplaDeviceClass::onTimerAll();
 }
-#else
+#elif !defined(ARDUINO_ARCH_HOST)
 ISR(TIMER1_COMPA_vect){
-    SuplaDevice.onTimer();
+    SuplaDeviceClass::onTimerAll();
+}
+#endif
+
+#ifndef ARDUINO_ARCH_HOST
+SuplaDeviceClass *SuplaDeviceClass::timer_list = NULL;
+#endif
+
+// Pending values are marked from the timer interrupt on AVR and sent from
+// iterate(), so their bookkeeping is done with interrupts off there
+#if defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_HOST)
+static inline uint8_t pendingLock(void) {
+    return 0;
+}
+
+static inline void pendingUnlock(uint8_t sreg) {
+}
+#else
+static inline uint8_t pendingLock(void) {
+    uint8_t sreg = SREG;
+    cli();
+    return sreg;
+}
+
+static inline void pendingUnlock(uint8_t sreg) {
+    SREG = sreg;
 }
 #endif
 
 _supla_int_t supla_arduino_data_read(void *buf, _supla_int_t count, void *sdc) {
-    return ((SuplaDeviceClass*)sdc)->getCallbacks().tcp_read(buf, count);
+    return ((SuplaDeviceClass*)sdc)->tcpRead(buf, count);
 }
 
 _supla_int_t supla_arduino_data_write(void *buf, _supla_int_t count, void *sdc) {
     
-    _supla_int_t r = ((SuplaDeviceClass*)sdc)->getCallbacks().tcp_write(buf, count);
+    _supla_int_t r = ((SuplaDeviceClass*)sdc)->tcpWrite(buf, count);
     if ( r > 0 ) {
         ((SuplaDeviceClass*)sdc)->onSent();
     }
@@ -104,7 +135,8 @@ void supla_arduino_on_remote_call_received(void *_srpc, unsigned _supla_int_t rr
 
 	((SuplaDeviceClass*)_sdc)->onResponse();
 
-	if ( SUPLA_RESULT_TRUE == ( result = srpc_getdata(_srpc, &rd, 0)) ) {
+	// Handlers below don't keep the pointers, so the payload can be decoded in place
+	if ( SUPLA_RESULT_TRUE == ( result = srpc_getdata_borrowed(_srpc, &rd, 0)) ) {
 		
 		switch(rd.call_type) {
 		case SUPLA_SDC_CALL_VERSIONERROR:
@@ -130,6 +162,14 @@ void supla_arduino_on_remote_call_received(void *_srpc, unsigned _supla_int_t rr
 	
 }
 
+void supla_arduino_on_out_writable(void *_srpc, void *_sdc) {
+	((SuplaDeviceClass*)_sdc)->onOutWritable();
+}
+
+void supla_arduino_on_out_dropped(void *_srpc, TSuplaDataPacket *sdp, unsigned char lane, void *_sdc) {
+	((SuplaDeviceClass*)_sdc)->onOutDropped(sdp, lane);
+}
+
 
 SuplaDeviceClass::SuplaDeviceClass() {
 
@@ -139,6 +179,7 @@ SuplaDeviceClass::SuplaDeviceClass() {
 	last_iterate_time = 0;
     wait_for_iterate = 0;
 	channel_pin = NULL;
+	values_pending = 0;
     roller_shutter = NULL;
     rs_count = 0;
 	
@@ -151,6 +192,10 @@ SuplaDeviceClass::SuplaDeviceClass() {
     impl_rs_load_settings = NULL;
     
     impl_arduino_timer = NULL;
+    
+    client = NULL;
+    timer_on = false;
+    in_timer = false;
 	
 	memset(&Params, 0, sizeof(SuplaDeviceParams));
 	
@@ -161,6 +206,13 @@ SuplaDeviceClass::SuplaDeviceClass() {
 }
 
 SuplaDeviceClass::~SuplaDeviceClass() {
+    timerStop();
+    
+    if ( srpc != NULL ) {
+        srpc_free(srpc);
+        srpc = NULL;
+    }
+    
 	if ( channel_pin != NULL ) {
 		free(channel_pin);
 		channel_pin = NULL;
@@ -229,6 +281,12 @@ void SuplaDeviceClass::setTimerFuncImpl(_impl_arduino_timer impl_arduino_timer)
     this->impl_arduino_timer = impl_arduino_timer;
 }
 
+void SuplaDeviceClass::setClient(Client *client) {
+    
+    if ( isInitialized(true) ) return;
+    this->client = client;
+}
+
 bool SuplaDeviceClass::isInitialized(bool msg) {
 	if ( srpc != NULL ) {
 		
@@ -247,12 +305,13 @@ bool SuplaDeviceClass::begin(IPAddress *local_ip, char GUID[SUPLA_GUID_SIZE], ui
 	unsigned char a;
 	if ( isInitialized(true) ) return false;
 	
-	if ( Params.cb.tcp_read == NULL
-	     || Params.cb.tcp_write == NULL
-	     || Params.cb.eth_setup == NULL
-	     || Params.cb.svr_connected == NULL
-	     || Params.cb.svr_connect == NULL
-	     || Params.cb.svr_disconnect == NULL ) {
+	if ( client == NULL
+	     && ( Params.cb.tcp_read == NULL
+	          || Params.cb.tcp_write == NULL
+	          || Params.cb.eth_setup == NULL
+	          || Params.cb.svr_connected == NULL
+	          || Params.cb.svr_connect == NULL
+	          || Params.cb.svr_disconnect == NULL ) ) {
 		
         status(STATUS_CB_NOT_ASSIGNED, "Callbacks not assigned!");
 		return false;
@@ -295,13 +354,17 @@ bool SuplaDeviceClass::begin(IPAddress *local_ip, char GUID[SUPLA_GUID_SIZE], ui
 	
 	setString(Params.reg_dev.SoftVer, "2.0.0", SUPLA_SOFTVER_MAXSIZE);
 	
-	Params.cb.eth_setup(Params.mac, Params.use_local_ip ? &Params.local_ip : NULL);
+	if ( client == NULL )
+		Params.cb.eth_setup(Params.mac, Params.use_local_ip ? &Params.local_ip : NULL);
 
 	TsrpcParams srpc_params;
 	srpc_params_init(&srpc_params);
 	srpc_params.data_read = &supla_arduino_data_read;
 	srpc_params.data_write = &supla_arduino_data_write;
 	srpc_params.on_remote_call_received = &supla_arduino_on_remote_call_received;
+	srpc_params.on_out_writable = &supla_arduino_on_out_writable;
+	srpc_params.on_out_dropped = &supla_arduino_on_out_dropped;
+	srpc_params.resync = 1;
 	srpc_params.user_params = this;
 	
 	srpc = srpc_init(&srpc_params);
@@ -315,25 +378,7 @@ bool SuplaDeviceClass::begin(IPAddress *local_ip, char GUID[SUPLA_GUID_SIZE], ui
             Params.reg_dev.channels[roller_shutter[a].channel_number].value[0] = (roller_shutter[a].position-100)/100;
         }
         
-        #ifdef ARDUINO_ARCH_ESP8266
-                os_timer_disarm(&esp_timer);
-                os_timer_setfn(&esp_timer, (os_timer_func_t *)esp_timer_cb, NULL);
-                os_timer_arm(&esp_timer, 10, 1);
-        #else
-                cli(); // disable interrupts
-                TCCR1A = 0;// set entire TCCR1A register to 0
-                TCCR1B = 0;// same for TCCR1B
-                TCNT1  = 0;//initialize counter value to 0
-                // set compare match register for 1hz increments
-                OCR1A = 155;// (16*10^6) / (100*1024) - 1 (must be <65536) == 155.25
-                // turn on CTC mode
-                TCCR1B |= (1 << WGM12);
-                // Set CS12 and CS10 bits for 1024 prescaler
-                TCCR1B |= (1 << CS12) | (1 << CS10);
-                // enable timer compare interrupt
-                TIMSK1 |= (1 << OCIE1A);
-                sei(); // enable interrupts
-        #endif
+        timerStart();
     }
     
     for(a=0;a<Params.reg_dev.channel_count;a++) {
@@ -424,6 +469,7 @@ int SuplaDeviceClass::addChannel(int pin1, int pin2, bool hiIsLo, bool bistable,
 	channel_pin[Params.reg_dev.channel_count].flag = flag;
 	channel_pin[Params.reg_dev.channel_count].DurationMS = DurationMS;
 	channel_pin[Params.reg_dev.channel_count].btn_next_check = 0;
+	channel_pin[Params.reg_dev.channel_count].value_pending = false;
 	
 	Params.reg_dev.channel_count++;
 	
@@ -784,6 +830,53 @@ SuplaDeviceCallbacks SuplaDeviceClass::getCallbacks(void) {
 	return Params.cb;
 }
 
+_supla_int_t SuplaDeviceClass::tcpRead(void *buf, _supla_int_t count) {
+    
+    if ( client == NULL )
+        return Params.cb.tcp_read(buf, count);
+    
+    _supla_int_t size = client->available();
+    
+    if ( size > 0 ) {
+        if ( size > count ) size = count;
+        return client->read((uint8_t *)buf, size);
+    }
+    
+    return -1;
+}
+
+_supla_int_t SuplaDeviceClass::tcpWrite(void *buf, _supla_int_t count) {
+    
+    if ( client == NULL )
+        return Params.cb.tcp_write(buf, count);
+    
+    return client->write((const uint8_t *)buf, count);
+}
+
+bool SuplaDeviceClass::svrConnect(void) {
+    
+    if ( client == NULL )
+        return Params.cb.svr_connect(Params.reg_dev.ServerName, 2015);
+    
+    return client->connect(Params.reg_dev.ServerName, 2015);
+}
+
+bool SuplaDeviceClass::svrConnected(void) {
+    
+    if ( client == NULL )
+        return Params.cb.svr_connected();
+    
+    return client->connected();
+}
+
+void SuplaDeviceClass::svrDisconnect(void) {
+    
+    if ( client == NULL )
+        Params.cb.svr_disconnect();
+    else
+        client->stop();
+}
+
 
 void SuplaDeviceClass::setString(char *dst, const char *src, int max_size) {
 	
@@ -1095,7 +1188,7 @@ void SuplaDeviceClass::iterate_thermometer(SuplaChannelPin *pin, TDS_SuplaDevice
                 pin->last_val_dbl2 = h;
                 
                 channelSetTempAndHumidityValue(channel_number, t, h);
-                srpc_ds_async_channel_value_changed(srpc, channel_number, channel->value);
+                channelValueSend(channel_number, channel->value, SRPC_LANE_DATA);
             }
             
         }
@@ -1406,18 +1499,18 @@ void SuplaDeviceClass::rs_buttons_processing(SuplaDeviceRollerShutter *rs) {
     
     if ( rs_button_released(&rs->btnUp) ) {
        
-        if ( SuplaDevice.rollerShutterMotorIsOn(rs->channel_number) ) {
-            SuplaDevice.rollerShutterStop(rs->channel_number);
+        if ( rollerShutterMotorIsOn(rs->channel_number) ) {
+            rollerShutterStop(rs->channel_number);
         } else {
-            SuplaDevice.rollerShutterReveal(rs->channel_number);
+            rollerShutterReveal(rs->channel_number);
         }
         
     } else if ( rs_button_released(&rs->btnDown) ) {
 
-        if ( SuplaDevice.rollerShutterMotorIsOn(rs->channel_number) ) {
-            SuplaDevice.rollerShutterStop(rs->channel_number);
+        if ( rollerShutterMotorIsOn(rs->channel_number) ) {
+            rollerShutterStop(rs->channel_number);
         } else {
-            SuplaDevice.rollerShutterShut(rs->channel_number);
+            rollerShutterShut(rs->channel_number);
         }
         ;
     }
@@ -1490,8 +1583,87 @@ void SuplaDeviceClass::iterate_rollershutter(SuplaDeviceRollerShutter *rs, Supla
     rs_buttons_processing(rs);
 }
 
+void SuplaDeviceClass::timerStart(void) {
+    
+    if ( timer_on ) return;
+    
+    #ifdef ARDUINO_ARCH_HOST
+        timer_last = millis();
+    #elif defined(ARDUINO_ARCH_ESP8266)
+        // os_timer callbacks never run in the middle of loop()
+        if ( timer_list == NULL ) {
+                os_timer_disarm(&esp_timer);
+                os_timer_setfn(&esp_timer, (os_timer_func_t *)esp_timer_cb, NULL);
+                os_timer_arm(&esp_timer, 10, 1);
+        }
+    
+        timer_next = timer_list;
+        timer_list = this;
+    #else
+        cli(); // disable interrupts
+        if ( timer_list == NULL ) {
+                TCCR1A = 0;// set entire TCCR1A register to 0
+                TCCR1B = 0;// same for TCCR1B
+                TCNT1  = 0;//initialize counter value to 0
+                // set compare match register for 1hz increments
+                OCR1A = 155;// (16*10^6) / (100*1024) - 1 (must be <65536) == 155.25
+                // turn on CTC mode
+                TCCR1B |= (1 << WGM12);
+                // Set CS12 and CS10 bits for 1024 prescaler
+                TCCR1B |= (1 << CS12) | (1 << CS10);
+                // enable timer compare interrupt
+                TIMSK1 |= (1 << OCIE1A);
+        }
+    
+        timer_next = timer_list;
+        timer_list = this;
+        sei(); // enable interrupts
+    #endif
+    
+    timer_on = true;
+}
+
+void SuplaDeviceClass::timerStop(void) {
+    
+    if ( !timer_on ) return;
+    
+    #ifndef ARDUINO_ARCH_HOST
+        #ifndef ARDUINO_ARCH_ESP8266
+        cli();
+        #endif
+    
+        SuplaDeviceClass **sdc = &timer_list;
+        while ( *sdc != this )
+            sdc = &(*sdc)->timer_next;
+        *sdc = timer_next;
+    
+        #ifdef ARDUINO_ARCH_ESP8266
+        if ( timer_list == NULL )
+            os_timer_disarm(&esp_timer);
+        #else
+        if ( timer_list == NULL )
+            TIMSK1 &= ~(1 << OCIE1A);
+        sei();
+        #endif
+    #endif
+    
+    timer_on = false;
+}
+
+#ifndef ARDUINO_ARCH_HOST
+void SuplaDeviceClass::onTimerAll(void) {
+    
+    for(SuplaDeviceClass *sdc = timer_list; sdc; sdc = sdc->timer_next) {
+        sdc->onTimer();
+    }
+}
+#endif
+
 void SuplaDeviceClass::onTimer(void) {
 
+    // Values changed from here are only marked, iterate() sends them
+    in_timer = true;
+
     if ( impl_arduino_timer ) {
         impl_arduino_timer();
     }
@@ -1500,6 +1672,7 @@ void SuplaDeviceClass::onTimer(void) {
         iterate_rollershutter(&roller_shutter[a], &channel_pin[roller_shutter[a].channel_number], &Params.reg_dev.channels[roller_shutter[a].channel_number]);
     }
     
+    in_timer = false;
 }
 
 void SuplaDeviceClass::iterate(void) {
@@ -1507,7 +1680,17 @@ void SuplaDeviceClass::iterate(void) {
     int a;
     unsigned long _millis = millis();
     unsigned long time_diff = abs(_millis - last_iterate_time);
-	if ( !Params.cb.svr_connected() ) {
+
+    #ifdef ARDUINO_ARCH_HOST
+    // No timer interrupt on the host, each instance runs its own timer
+    // between iterations
+    if ( timer_on && _millis - timer_last >= 10 ) {
+        timer_last = _millis;
+        onTimer();
+    }
+    #endif
+
+	if ( !svrConnected() ) {
 		if ( time_diff > 0 ) {
 			for(a=0;a<Params.reg_dev.channel_count;a++) {
 				
@@ -1532,7 +1715,7 @@ void SuplaDeviceClass::iterate(void) {
     
 	if ( !isInitialized(false) ) return;
 	
-	if ( !Params.cb.svr_connected() ) {
+	if ( !svrConnected() ) {
 		
 		status(STATUS_DISCONNECTED, "Not connected");
 	    registered = 0;
@@ -1540,10 +1723,10 @@ void SuplaDeviceClass::iterate(void) {
         last_sent = 0;
 	    last_ping_time = 0;
         
-		if ( !Params.cb.svr_connect(Params.reg_dev.ServerName, 2015) ) {
+		if ( !svrConnect() ) {
 			
 		    	supla_log(LOG_DEBUG, "Connection fail. Server: %s", Params.reg_dev.ServerName);
-		    	Params.cb.svr_disconnect();
+		    	svrDisconnect();
 
                 wait_for_iterate = millis() + 5000;
 				return;
@@ -1558,18 +1741,25 @@ void SuplaDeviceClass::iterate(void) {
 		srpc_ds_async_registerdevice_c(srpc, &Params.reg_dev);
 		status(STATUS_REGISTER_IN_PROGRESS, "Register in progress");
 		
+		uint8_t sreg = pendingLock();
+		
 		for(a=0;a<Params.reg_dev.channel_count;a++) {
                 
                channel_pin[a].start = 0;
+               // Registration carries the current values
+               channel_pin[a].value_pending = false;
                 
             }
+		values_pending = 0;
+		
+		pendingUnlock(sreg);
 		
 	} else if ( registered == 1 ) {
 		// PING
 		if ( (_millis-last_response)/1000 >= (server_activity_timeout+10)  ) {
 			
 			supla_log(LOG_DEBUG, "TIMEOUT");
-			Params.cb.svr_disconnect();
+			svrDisconnect();
 
 		} else if ( _millis-last_ping_time >= 1000
 				    && ( (_millis-last_response)/1000 >= (server_activity_timeout-5)
@@ -1593,14 +1783,16 @@ void SuplaDeviceClass::iterate(void) {
         }
 	}
 
-	if( srpc_iterate(srpc) == SUPLA_RESULT_FALSE ) {
+	if( srpc_iterate_batch(srpc, SRPC_ITERATE_MAX_COUNT) == SUPLA_RESULT_FALSE ) {
 		status(STATUS_ITERATE_FAIL, "Iterate fail");
-		Params.cb.svr_disconnect();
+		svrDisconnect();
         
 		wait_for_iterate = millis() + 5000;
         return;
 	}
 	
+	if ( registered == 1 && values_pending > 0 )
+		channelValueFlush();
 	
 }
 
@@ -1608,13 +1800,35 @@ void SuplaDeviceClass::onResponse(void) {
 	last_response = millis();
 }
 
+void SuplaDeviceClass::onOutWritable(void) {
+	if ( registered == 1 )
+		channelValueFlush();
+}
+
+void SuplaDeviceClass::onOutDropped(TSuplaDataPacket *sdp, unsigned char lane) {
+
+	if ( sdp->call_type != SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED )
+		return;
+
+	int channel_number = ((TDS_SuplaDeviceChannelValue*)sdp->data)->ChannelNumber;
+
+	if ( channel_number >= Params.reg_dev.channel_count )
+		return;
+
+	// Called from inside another srpc call, so the value is only marked here.
+	// pending_value is the latest one, which may be newer than the dropped one.
+	uint8_t sreg = pendingLock();
+	channelValueMark(&channel_pin[channel_number], lane);
+	pendingUnlock(sreg);
+}
+
 void SuplaDeviceClass::onSent(void) {
     last_sent = millis();
 }
 
 void SuplaDeviceClass::onVersionError(TSDC_SuplaVersionError *version_error) {
 	status(STATUS_PROTOCOL_VERSION_ERROR, "Protocol version error");
-	Params.cb.svr_disconnect();
+	svrDisconnect();
     
     wait_for_iterate = millis()+5000;
 }
@@ -1692,7 +1906,7 @@ void SuplaDeviceClass::onRegisterResult(TSD_SuplaRegisterDeviceResult *register_
             break;
 	}
 
-	Params.cb.svr_disconnect();
+	svrDisconnect();
     wait_for_iterate = millis() + 5000;
 }
 
@@ -1711,11 +1925,93 @@ void SuplaDeviceClass::channelValueChanged(int channel_number, char v, double d,
         
         supla_log(LOG_DEBUG, "Value changed");
 
-		srpc_ds_async_channel_value_changed(srpc, channel_number, value);
+		// Binary states are actuator feedback, doubles are measurements
+		channelValueSend(channel_number, value, var == 1 ? SRPC_LANE_STATE : SRPC_LANE_DATA);
 	}
 
 }
 
+void SuplaDeviceClass::channelValueSend(int channel_number, char value[SUPLA_CHANNELVALUE_SIZE], unsigned char lane) {
+
+	if ( channel_number < 0 || channel_number >= Params.reg_dev.channel_count ) {
+		srpc_ds_async_channel_value_changed_ex(srpc, channel_number, value, lane);
+		return;
+	}
+
+	SuplaChannelPin *pin = &channel_pin[channel_number];
+	_supla_int_t result = SUPLA_RESULT_FALSE;
+
+	uint8_t sreg = pendingLock();
+
+	// Kept after it is sent too, for onOutDropped
+	memcpy(pin->pending_value, value, SUPLA_CHANNELVALUE_SIZE);
+
+	// A value already waiting is replaced rather than overtaken. The timer
+	// never calls srpc, it only marks the value.
+	bool send = !in_timer && !pin->value_pending;
+
+	pendingUnlock(sreg);
+
+	if ( send
+		 && ( lane != SRPC_LANE_DATA || srpc_out_queue_free(srpc) > SRPC_DATA_QUEUE_RESERVE ) )
+		result = srpc_ds_async_channel_value_changed_ex(srpc, channel_number, value, lane);
+
+	if ( result != SUPLA_RESULT_FALSE )
+		return;
+
+	sreg = pendingLock();
+	channelValueMark(pin, lane);
+	pendingUnlock(sreg);
+}
+
+// The caller keeps the timer out
+void SuplaDeviceClass::channelValueMark(SuplaChannelPin *pin, unsigned char lane) {
+
+	if ( !pin->value_pending ) {
+		pin->value_pending = true;
+		pin->pending_lane = lane;
+		values_pending++;
+	} else if ( lane < pin->pending_lane ) {
+		pin->pending_lane = lane;
+	}
+}
+
+void SuplaDeviceClass::channelValueFlush(void) {
+
+	char value[SUPLA_CHANNELVALUE_SIZE];
+	unsigned char lane;
+	uint8_t sreg;
+
+	for(int a=0;a<Params.reg_dev.channel_count && values_pending > 0;a++) {
+
+		SuplaChannelPin *pin = &channel_pin[a];
+
+		// Taken off before the call, so a value the timer marks meanwhile
+		// stays pending
+		sreg = pendingLock();
+
+		if ( !pin->value_pending
+			 || ( pin->pending_lane == SRPC_LANE_DATA && srpc_out_queue_free(srpc) <= SRPC_DATA_QUEUE_RESERVE ) ) {
+			pendingUnlock(sreg);
+			continue;
+		}
+
+		memcpy(value, pin->pending_value, SUPLA_CHANNELVALUE_SIZE);
+		lane = pin->pending_lane;
+		pin->value_pending = false;
+		values_pending--;
+
+		pendingUnlock(sreg);
+
+		if ( srpc_ds_async_channel_value_changed_ex(srpc, a, value, lane) == SUPLA_RESULT_FALSE ) {
+			sreg = pendingLock();
+			channelValueMark(pin, lane);
+			pendingUnlock(sreg);
+			return;
+		}
+	}
+}
+
 void SuplaDeviceClass::channelDoubleValueChanged(int channel_number, double v) {
 	channelValueChanged(channel_number, 0, v, 2);
 	
@@ -1820,7 +2116,7 @@ void SuplaDeviceClass::channelSetRGBWvalue(int channel, char value[SUPLA_CHANNEL
 		
 		setRGBWvalue(channel, value);
 
-		srpc_ds_async_channel_value_changed(srpc, Params.reg_dev.channels[channel].Number, value);
+		channelValueSend(Params.reg_dev.channels[channel].Number, value, SRPC_LANE_STATE);
 	}
 	
 }
@@ -19,6 +19,7 @@
 
 #include "proto.h"
 #include <IPAddress.h>
+#include <Client.h>
 
 #define INPUT_TYPE_BTN_BISTABLE			0 
 #define INPUT_TYPE_BTN_MONOSTABLE		1 
@@ -121,6 +122,12 @@ typedef struct SuplaChannelPin {
 	uint8_t last_val;
 	double last_val_dbl1;
 	double last_val_dbl2;
+	
+	// Latest value of the channel. Pending while srpc has no room for it or
+	// after srpc dropped it from the out queue, sent once there is room.
+	bool value_pending;
+	unsigned char pending_lane;
+	char pending_value[SUPLA_CHANNELVALUE_SIZE];
 };
 
 typedef struct SuplaDeviceRollerShutterTask {
@@ -181,6 +188,9 @@ protected:
 	void setString(char *dst, const char *src, int max_size);
 	int addChannel(int pin1, int pin2, bool hiIsLo, bool bistable, int type = NULL, int flag = NULL, _supla_int_t DurationMS = 0);
 	void channelValueChanged(int channel_number, char v, double d, char var);
+	void channelValueSend(int channel_number, char value[SUPLA_CHANNELVALUE_SIZE], unsigned char lane);
+	void channelValueFlush(void);
+	void channelValueMark(SuplaChannelPin *pin, unsigned char lane);
 	void channelSetValue(int channel, char value, _supla_int_t DurationMS);
 	void channelSetDoubleValue(int channelNum, double value);
 	void setDoubleValue(char value[SUPLA_CHANNELVALUE_SIZE], double v);
@@ -192,6 +202,7 @@ protected:
 	SuplaDeviceParams Params;
 	_supla_int_t server_activity_timeout, last_response, last_sent;
 	SuplaChannelPin *channel_pin;
+	int values_pending;
     
     int rs_count;
     SuplaDeviceRollerShutter *roller_shutter;
@@ -212,6 +223,21 @@ protected:
     _impl_rs_load_settings impl_rs_load_settings;
     
     _impl_arduino_timer impl_arduino_timer;
+    
+    Client *client;
+    
+    bool timer_on;
+    bool in_timer;  // onTimer is running
+#ifdef ARDUINO_ARCH_HOST
+    unsigned long timer_last;
+#else
+    // Started instances, all run from the one hardware timer
+    static SuplaDeviceClass *timer_list;
+    SuplaDeviceClass *timer_next;
+#endif
+    
+    void timerStart(void);
+    void timerStop(void);
 
     void rs_save_position(SuplaDeviceRollerShutter *rs);
     void rs_load_position(SuplaDeviceRollerShutter *rs);
@@ -241,6 +267,9 @@ private:
 	int suplaDigitalRead(int channelNumber, uint8_t pin);
     bool suplaDigitalRead_isHI(int channelNumber, uint8_t pin);
 	void suplaDigitalWrite(int channelNumber, uint8_t pin, uint8_t val);
+    bool svrConnect(void);
+    bool svrConnected(void);
+    void svrDisconnect(void);
     void suplaDigitalWrite_setHI(int channelNumber, uint8_t pin, bool hi);
     void status(int status, const char *msg);
 public:
@@ -297,9 +326,17 @@ public:
    bool rollerShutterMotorIsOn(int channel_number);
    
    void onTimer(void);
+#ifndef ARDUINO_ARCH_HOST
+   static void onTimerAll(void);
+#endif
    void iterate(void);
    
    SuplaDeviceCallbacks getCallbacks(void);
+   // Connection of this instance only. Replaces the tcp_* and svr_* callbacks,
+   // and eth_setup is not called, so the network has to be up already.
+   void setClient(Client *client);
+   _supla_int_t tcpRead(void *buf, _supla_int_t count);
+   _supla_int_t tcpWrite(void *buf, _supla_int_t count);
    void setSaveRelayStateCallback(_cb_arduino_set_relay_state save_supla_relay_state);
    void setReadRelayStateCallback(_cb_arduino_get_relay_state read_supla_relay_state);
    void setTemperatureCallback(_cb_arduino_get_double get_temperature);
@@ -322,6 +359,8 @@ public:
     
    void onSent(void);
    void onResponse(void);
+   void onOutWritable(void);
+   void onOutDropped(TSuplaDataPacket *sdp, unsigned char lane);
    void onVersionError(TSDC_SuplaVersionError *version_error);
    void onRegisterResult(TSD_SuplaRegisterDeviceResult *register_device_result);
    void onSensorInterrupt(void);
@@ -0,0 +1,208 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "eh.h"
+
+// Microcontroller builds have no file descriptors to wait on. srpc does not
+// raise events there (__EH_DISABLED).
+#if !defined(ESP8266) && !defined(__AVR__) && !defined(_WIN32)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define EH_MAX_EVENTS 8
+#endif /*__linux__*/
+
+TEventHandler *eh_init(void) {
+#ifdef __linux__
+  struct epoll_event event;
+#else
+  int a;
+#endif /*__linux__*/
+  TEventHandler *eh = (TEventHandler *)malloc(sizeof(TEventHandler));
+
+  if (eh == NULL) {
+    return NULL;
+  }
+
+  memset(eh, 0, sizeof(TEventHandler));
+  eh->fd2 = -1;
+  eh->fd3 = -1;
+
+#ifdef __linux__
+  eh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  eh->fd1 = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = eh->fd1;
+
+  if (eh->epoll_fd == -1 || eh->fd1 == -1 ||
+      epoll_ctl(eh->epoll_fd, EPOLL_CTL_ADD, eh->fd1, &event) == -1) {
+    eh_free(eh);
+    return NULL;
+  }
+#else
+  if (pipe(eh->fd1) == -1) {
+    free(eh);
+    return NULL;
+  }
+
+  // Raising an event must never block, a full pipe is as good as one byte
+  for (a = 0; a < 2; a++) {
+    fcntl(eh->fd1[a], F_SETFL, fcntl(eh->fd1[a], F_GETFL) | O_NONBLOCK);
+    fcntl(eh->fd1[a], F_SETFD, FD_CLOEXEC);
+  }
+
+  eh->nfds = eh->fd1[0] + 1;
+#endif /*__linux__*/
+
+  return eh;
+}
+
+void eh_add_fd(TEventHandler *eh, int fd) {
+#ifdef __linux__
+  struct epoll_event event;
+#endif /*__linux__*/
+
+  if (eh == NULL || fd < 0) {
+    return;
+  }
+
+#ifdef __linux__
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+
+  if (epoll_ctl(eh->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1 &&
+      errno == EEXIST) {
+    epoll_ctl(eh->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  }
+#else
+  // select() waits on the event pipe and at most two descriptors more
+  if (eh->fd2 == -1 || eh->fd2 == fd) {
+    eh->fd2 = fd;
+  } else {
+    eh->fd3 = fd;
+  }
+
+  if (fd + 1 > eh->nfds) {
+    eh->nfds = fd + 1;
+  }
+#endif /*__linux__*/
+}
+
+void eh_raise_event(TEventHandler *eh) {
+  if (eh == NULL) {
+    return;
+  }
+
+#ifdef __linux__
+  eventfd_write(eh->fd1, 1);
+#else
+  // A full pipe (EAGAIN) means an event is pending already
+  if (write(eh->fd1[1], "", 1) == -1) {
+    return;
+  }
+#endif /*__linux__*/
+}
+
+// Blocks until an event is raised, a descriptor becomes readable or usec
+// elapses. A negative usec waits with no time limit. Returns the number of
+// ready sources, 0 on timeout or -1 on error.
+int eh_wait(TEventHandler *eh, int usec) {
+#ifdef __linux__
+  struct epoll_event events[EH_MAX_EVENTS];
+  eventfd_t value;
+  int a;
+#else
+  fd_set set;
+  char buffer[64];
+#endif /*__linux__*/
+  int result;
+
+  if (eh == NULL) {
+    return -1;
+  }
+
+#ifdef __linux__
+  result = epoll_wait(eh->epoll_fd, events, EH_MAX_EVENTS,
+                      usec < 0 ? -1 : (usec + 999) / 1000);
+
+  for (a = 0; a < result; a++) {
+    if (events[a].data.fd == eh->fd1) {
+      eventfd_read(eh->fd1, &value);
+    }
+  }
+#else
+  FD_ZERO(&set);
+  FD_SET(eh->fd1[0], &set);
+
+  if (eh->fd2 != -1) {
+    FD_SET(eh->fd2, &set);
+  }
+
+  if (eh->fd3 != -1) {
+    FD_SET(eh->fd3, &set);
+  }
+
+  if (usec >= 0) {
+    eh->tv.tv_sec = usec / 1000000;
+    eh->tv.tv_usec = usec % 1000000;
+  }
+
+  result = select(eh->nfds, &set, NULL, NULL, usec >= 0 ? &eh->tv : NULL);
+
+  if (result > 0 && FD_ISSET(eh->fd1[0], &set)) {
+    while (read(eh->fd1[0], buffer, sizeof(buffer)) > 0) {
+    }
+  }
+#endif /*__linux__*/
+
+  return result;
+}
+
+void eh_free(TEventHandler *eh) {
+  if (eh == NULL) {
+    return;
+  }
+
+#ifdef __linux__
+  if (eh->fd1 != -1) {
+    close(eh->fd1);
+  }
+
+  if (eh->epoll_fd != -1) {
+    close(eh->epoll_fd);
+  }
+#else
+  close(eh->fd1[0]);
+  close(eh->fd1[1]);
+#endif /*__linux__*/
+
+  free(eh);
+}
+
+#endif /*!defined(ESP8266) && !defined(__AVR__) && !defined(_WIN32)*/
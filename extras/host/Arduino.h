@@ -0,0 +1,117 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+// The part of the Arduino core SuplaDevice uses, mapped onto host_hal
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#ifndef ARDUINO
+#define ARDUINO 10800
+#endif
+#define ARDUINO_ARCH_HOST
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+
+#define F(str) (str)
+
+#ifdef abs
+#undef abs
+#endif
+#define abs(x) ((x) > 0 ? (x) : -(x))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+class String {
+ public:
+  String(const char *str = "") : s(str ? str : "") {}
+  String(const std::string &str) : s(str) {}
+
+  const char *c_str(void) const { return s.c_str(); }
+  unsigned int length(void) const { return s.length(); }
+  long toInt(void) const { return atol(s.c_str()); }
+
+  bool operator==(const String &other) const { return s == other.s; }
+  bool operator!=(const String &other) const { return s != other.s; }
+  String &operator+=(const String &other) {
+    s += other.s;
+    return *this;
+  }
+
+ private:
+  std::string s;
+};
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud) {}
+
+  size_t print(const char *str);
+  size_t print(const String &str);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println(void);
+  size_t println(const char *str);
+  size_t println(const String &str);
+  size_t println(char c);
+  size_t println(unsigned char n, int base = DEC);
+  size_t println(int n, int base = DEC);
+  size_t println(unsigned int n, int base = DEC);
+  size_t println(long n, int base = DEC);
+  size_t println(unsigned long n, int base = DEC);
+  size_t println(double n, int digits = 2);
+};
+
+extern HardwareSerial Serial;
+
+#include "host_hal.h"
+
+#endif /* ARDUINO_H_ */
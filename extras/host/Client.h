@@ -0,0 +1,38 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The part of the Arduino Client interface SuplaDeviceClass::setClient uses
+class Client {
+ public:
+  virtual ~Client() {}
+
+  virtual int connect(const char *host, uint16_t port) = 0;
+  virtual uint8_t connected(void) = 0;
+  virtual int available(void) = 0;
+  virtual int read(uint8_t *buf, size_t size) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size) = 0;
+  virtual void stop(void) = 0;
+};
+
+#endif /* CLIENT_H_ */
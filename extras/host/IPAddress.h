@@ -0,0 +1,44 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef IPADDRESS_H_
+#define IPADDRESS_H_
+
+#include <stdint.h>
+
+class IPAddress {
+ public:
+  IPAddress() { address.dword = 0; }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    address.bytes[0] = a;
+    address.bytes[1] = b;
+    address.bytes[2] = c;
+    address.bytes[3] = d;
+  }
+
+  uint8_t operator[](int index) const { return address.bytes[index]; }
+  uint8_t &operator[](int index) { return address.bytes[index]; }
+
+ private:
+  union {
+    uint8_t bytes[4];
+    uint32_t dword;
+  } address;
+};
+
+#endif /* IPADDRESS_H_ */
@@ -0,0 +1,88 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// Sample device for the host build: two relays with buttons, a door sensor
+// and a thermometer, all on simulated pins. The server and credentials come
+// from SUPLA_SERVER, SUPLA_LOCATION_ID, SUPLA_LOCATION_PWD and SUPLA_GUID
+// (32 hex digits, derived from the pid when not set). Button and sensor pins
+// can be flipped with host_gpio_drive, relay pins are printed as they change.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Added to sketches by the Arduino IDE
+#include <Arduino.h>
+#include <SuplaDevice.h>
+
+#define RELAY1_PIN 10
+#define RELAY2_PIN 11
+#define BUTTON1_PIN 20
+#define BUTTON2_PIN 21
+#define SENSOR_PIN 30
+
+static const char *env(const char *name, const char *def) {
+  const char *value = getenv(name);
+  return value ? value : def;
+}
+
+static void gpio_on_write(uint8_t pin, uint8_t value) {
+  printf("pin %i = %i\n", pin, value);
+}
+
+static double get_temperature(int channelNumber, double last_val) {
+  // A slow sine around 21 C, so the value changes between reads
+  return 21.0 + sin(millis() / 60000.0) * 2.0;
+}
+
+void setup() {
+  char GUID[SUPLA_GUID_SIZE] = {0};
+  uint8_t mac[6] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05};
+  const char *guid_hex = env("SUPLA_GUID", "");
+
+  for (int a = 0; a < SUPLA_GUID_SIZE && guid_hex[a * 2] && guid_hex[a * 2 + 1];
+       a++) {
+    unsigned int b = 0;
+    sscanf(&guid_hex[a * 2], "%2x", &b);
+    GUID[a] = b;
+  }
+
+  if (guid_hex[0] == 0) {
+    // Distinct per process, so several instances can run side by side
+    pid_t pid = getpid();
+    memcpy(GUID, &pid, sizeof(pid));
+  }
+
+  host_gpio_set_write_callback(gpio_on_write);
+  SuplaDevice.setTemperatureCallback(get_temperature);
+
+  SuplaDevice.addRelayButton(RELAY1_PIN, BUTTON1_PIN, INPUT_TYPE_BTN_MONOSTABLE,
+                              RELAY_FLAG_RESET);
+  SuplaDevice.addRelayButton(RELAY2_PIN, BUTTON2_PIN, INPUT_TYPE_BTN_MONOSTABLE,
+                              RELAY_FLAG_RESET);
+  SuplaDevice.addSensorNO(SENSOR_PIN);
+  SuplaDevice.addDS18B20Thermometer();
+
+  SuplaDevice.setName("HOST");
+  SuplaDevice.begin(GUID, mac, env("SUPLA_SERVER", "127.0.0.1"),
+                    atoi(env("SUPLA_LOCATION_ID", "1")),
+                    env("SUPLA_LOCATION_PWD", "0"));
+}
+
+void loop() { SuplaDevice.iterate(); }
@@ -0,0 +1,148 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// Many independent devices in one process, for load testing a server. Each
+// device has its own SuplaDeviceClass and HostClient, and each thread of the
+// pool iterates a fixed slice of them, so no device is ever touched by two
+// threads. Built like host_device.cpp, but without host_main.cpp:
+//
+//   host_fleet [-d] [-n devices] [-t threads] [-s sleep_us]
+//
+// The server and credentials come from SUPLA_SERVER, SUPLA_LOCATION_ID and
+// SUPLA_LOCATION_PWD. GUIDs are derived from the pid and the device index.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <SuplaDevice.h>
+
+#define RELAY_PIN 10
+#define SENSOR_PIN 30
+
+typedef struct {
+  SuplaDeviceClass sdc;
+  HostClient client;
+} THostFleetDevice;
+
+typedef struct {
+  THostFleetDevice *devices;
+  int first;
+  int count;
+  useconds_t sleep_us;
+} THostFleetSlice;
+
+static const char *env(const char *name, const char *def) {
+  const char *value = getenv(name);
+  return value ? value : def;
+}
+
+static double get_temperature(int channelNumber, double last_val) {
+  return 21.0 + sin(millis() / 60000.0) * 2.0;
+}
+
+static bool device_begin(THostFleetDevice *dev, int idx) {
+  char GUID[SUPLA_GUID_SIZE] = {0};
+  uint8_t mac[6] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05};
+  char name[SUPLA_DEVICE_NAME_MAXSIZE];
+  pid_t pid = getpid();
+
+  memcpy(GUID, &pid, sizeof(pid));
+  memcpy(&GUID[sizeof(pid)], &idx, sizeof(idx));
+  snprintf(name, sizeof(name), "HOST-%i", idx);
+
+  dev->sdc.setClient(&dev->client);
+  dev->sdc.setTemperatureCallback(get_temperature);
+  dev->sdc.addRelay(RELAY_PIN);
+  dev->sdc.addSensorNO(SENSOR_PIN);
+  dev->sdc.addDS18B20Thermometer();
+  dev->sdc.setName(name);
+
+  return dev->sdc.begin(GUID, mac, env("SUPLA_SERVER", "127.0.0.1"),
+                        atoi(env("SUPLA_LOCATION_ID", "1")),
+                        env("SUPLA_LOCATION_PWD", "0"));
+}
+
+static void *slice_run(void *arg) {
+  THostFleetSlice *slice = (THostFleetSlice *)arg;
+
+  for (int a = 0; a < slice->count; a++) {
+    device_begin(&slice->devices[a], slice->first + a);
+  }
+
+  while (host_hal_running()) {
+    for (int a = 0; a < slice->count; a++) slice->devices[a].sdc.iterate();
+
+    if (slice->sleep_us) usleep(slice->sleep_us);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int device_count = 100;
+  int thread_count = 4;
+  useconds_t sleep_us = 1000;
+  int opt;
+
+  host_hal_init(argc, argv);
+
+  while ((opt = getopt(argc, argv, "dn:t:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        device_count = atoi(optarg);
+        break;
+      case 't':
+        thread_count = atoi(optarg);
+        break;
+      case 's':
+        sleep_us = atoi(optarg);
+        break;
+    }
+  }
+
+  if (device_count < 1) device_count = 1;
+  if (thread_count < 1) thread_count = 1;
+  if (thread_count > device_count) thread_count = device_count;
+
+  THostFleetDevice *devices = new THostFleetDevice[device_count];
+  THostFleetSlice *slices = new THostFleetSlice[thread_count];
+  pthread_t *threads = new pthread_t[thread_count];
+
+  for (int a = 0, first = 0; a < thread_count; a++) {
+    slices[a].devices = &devices[first];
+    slices[a].first = first;
+    slices[a].count = device_count / thread_count +
+                      (a < device_count % thread_count ? 1 : 0);
+    slices[a].sleep_us = sleep_us;
+    first += slices[a].count;
+
+    pthread_create(&threads[a], NULL, slice_run, &slices[a]);
+  }
+
+  for (int a = 0; a < thread_count; a++) pthread_join(threads[a], NULL);
+
+  delete[] threads;
+  delete[] slices;
+  delete[] devices;
+
+  return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "Arduino.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+int debug_mode = 0;
+int run_as_daemon = 0;
+
+HardwareSerial Serial;
+
+typedef struct {
+  uint8_t mode;
+  uint8_t latch;
+  uint8_t driven;
+  uint8_t driven_level;
+} THostGpio;
+
+// Zero is INPUT, LOW and not driven, so no thread has to set up its bank
+static __thread THostGpio host_gpio[HOST_GPIO_COUNT];
+static _host_gpio_on_write host_gpio_on_write = NULL;
+
+static unsigned long long host_start_us = 0;
+
+static int host_running = 1;
+
+static unsigned long long host_clock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Read by every thread iterating devices
+static void host_signal_handler(int sig) {
+  __atomic_store_n(&host_running, 0, __ATOMIC_RELAXED);
+}
+
+void host_hal_init(int argc, char **argv) {
+  struct sigaction sa;
+
+  host_start_us = host_clock_us();
+
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "-d") == 0) debug_mode = 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = host_signal_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+bool host_hal_running(void) {
+  return __atomic_load_n(&host_running, __ATOMIC_RELAXED) != 0;
+}
+
+unsigned long long host_micros(void) {
+  return host_clock_us() - host_start_us;
+}
+
+unsigned long millis(void) { return host_micros() / 1000; }
+
+unsigned long micros(void) { return host_micros(); }
+
+void delay(unsigned long ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) { host_gpio[pin].mode = mode; }
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  host_gpio[pin].latch = value == LOW ? LOW : HIGH;
+
+  if (host_gpio_on_write) host_gpio_on_write(pin, host_gpio[pin].latch);
+}
+
+int digitalRead(uint8_t pin) {
+  THostGpio *gpio = &host_gpio[pin];
+
+  if (gpio->mode == OUTPUT) return gpio->latch;
+
+  if (gpio->driven) return gpio->driven_level;
+
+  return gpio->mode == INPUT_PULLUP ? HIGH : LOW;
+}
+
+void host_gpio_drive(uint8_t pin, int value) {
+  host_gpio[pin].driven = value != -1;
+  host_gpio[pin].driven_level = value == LOW ? LOW : HIGH;
+}
+
+uint8_t host_gpio_mode(uint8_t pin) { return host_gpio[pin].mode; }
+
+void host_gpio_set_write_callback(_host_gpio_on_write on_write) {
+  host_gpio_on_write = on_write;
+}
+
+size_t HardwareSerial::print(const char *str) {
+  return fputs(str, stdout) < 0 ? 0 : strlen(str);
+}
+
+size_t HardwareSerial::print(const String &str) { return print(str.c_str()); }
+
+size_t HardwareSerial::print(char c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+
+size_t HardwareSerial::print(long n, int base) {
+  return printf(base == HEX ? "%lx" : "%ld", n);
+}
+
+size_t HardwareSerial::print(unsigned long n, int base) {
+  return printf(base == HEX ? "%lx" : "%lu", n);
+}
+
+size_t HardwareSerial::print(int n, int base) { return print((long)n, base); }
+
+size_t HardwareSerial::print(unsigned int n, int base) {
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(unsigned char n, int base) {
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(double n, int digits) {
+  return printf("%.*f", digits, n);
+}
+
+size_t HardwareSerial::println(void) { return print('\n'); }
+
+size_t HardwareSerial::println(const char *str) {
+  return print(str) + println();
+}
+
+size_t HardwareSerial::println(const String &str) {
+  return print(str) + println();
+}
+
+size_t HardwareSerial::println(char c) { return print(c) + println(); }
+
+size_t HardwareSerial::println(long n, int base) {
+  return print(n, base) + println();
+}
+
+size_t HardwareSerial::println(unsigned long n, int base) {
+  return print(n, base) + println();
+}
+
+size_t HardwareSerial::println(int n, int base) {
+  return print(n, base) + println();
+}
+
+size_t HardwareSerial::println(unsigned int n, int base) {
+  return print(n, base) + println();
+}
+
+size_t HardwareSerial::println(unsigned char n, int base) {
+  return print(n, base) + println();
+}
+
+size_t HardwareSerial::println(double n, int digits) {
+  return print(n, digits) + println();
+}
+
+HostClient::HostClient() { sfd = -1; }
+
+HostClient::~HostClient() { stop(); }
+
+int HostClient::connect(const char *host, uint16_t port) {
+  struct addrinfo hints, *res, *ai;
+  char service[6];
+  int yes = 1;
+
+  stop();
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+
+  if (getaddrinfo(host, service, &hints, &res) != 0) return 0;
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sfd == -1) continue;
+
+    if (::connect(sfd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+    close(sfd);
+    sfd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if (sfd == -1) return 0;
+
+  // srpc writes whole packets; don't let Nagle hold them back
+  setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK);
+
+  return 1;
+}
+
+uint8_t HostClient::connected(void) {
+  char c;
+
+  if (sfd == -1) return 0;
+
+  ssize_t r = recv(sfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  if (r > 0) return 1;
+
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 1;
+
+  return 0;
+}
+
+int HostClient::available(void) {
+  int count = 0;
+
+  if (sfd == -1 || ioctl(sfd, FIONREAD, &count) == -1) return 0;
+
+  return count;
+}
+
+int HostClient::read(uint8_t *buf, size_t size) {
+  if (sfd == -1) return -1;
+
+  ssize_t r = recv(sfd, buf, size, MSG_DONTWAIT);
+
+  return r > 0 ? r : -1;
+}
+
+size_t HostClient::write(const uint8_t *buf, size_t size) {
+  if (sfd == -1) return 0;
+
+  ssize_t r = send(sfd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  return r > 0 ? r : 0;
+}
+
+void HostClient::stop(void) {
+  if (sfd != -1) {
+    close(sfd);
+    sfd = -1;
+  }
+}
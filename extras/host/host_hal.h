@@ -0,0 +1,75 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef HOST_HAL_H_
+#define HOST_HAL_H_
+
+// Host (Linux) stand-in for the Arduino core, so SuplaDeviceClass runs as a
+// native process that can be debugged, profiled and load tested. A sketch
+// is built with this directory ahead of the library on the include path:
+//
+//   cc -c -O2 -I. ../../srpc.c ../../proto.c ../../lck.c ../../eh.c
+//   c++ -O2 -I. -I../.. -o host_device host_device.cpp host_main.cpp
+//       host_hal.cpp ../../SuplaDevice.cpp ../../log.cpp *.o -lpthread
+//
+// There are no interrupts. Each SuplaDeviceClass instance runs its own timer
+// from iterate() instead, so instances can be iterated on different threads.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Client.h"
+
+#define HOST_GPIO_COUNT 256
+
+// Simulated GPIO bank, one per thread. An output reads back what was written,
+// an input the level driven from outside, or its pull-up.
+typedef void (*_host_gpio_on_write)(uint8_t pin, uint8_t value);
+
+// -1 stops driving the pin
+void host_gpio_drive(uint8_t pin, int value);
+uint8_t host_gpio_mode(uint8_t pin);
+// Called after every digitalWrite
+void host_gpio_set_write_callback(_host_gpio_on_write on_write);
+
+// Monotonic clock since host_hal_init
+unsigned long long host_micros(void);
+
+// -d on the command line enables debug logging
+void host_hal_init(int argc, char **argv);
+// False once SIGINT or SIGTERM was received
+bool host_hal_running(void);
+
+// TCP client for supla_main_helper and SuplaDeviceClass::setClient
+class HostClient : public Client {
+ public:
+  HostClient();
+  virtual ~HostClient();
+
+  int connect(const char *host, uint16_t port);
+  uint8_t connected(void);
+  int available(void);
+  int read(uint8_t *buf, size_t size);
+  size_t write(const uint8_t *buf, size_t size);
+  void stop(void);
+
+ private:
+  int sfd;
+};
+
+#endif /* HOST_HAL_H_ */
@@ -0,0 +1,674 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+// Local stand-in for the SUPLA server, for end to end benchmarks of the
+// host build (see host_hal.h). It accepts devices on localhost, registers
+// every REGISTER_DEVICE_C, answers pings and sends CHANNEL_SET_VALUE to the
+// relay channels of the registered devices at a fixed rate. A command is
+// done once the device reports the new value of the channel. Sessions run
+// with fixed ring buffers of ring_size bytes (0 - growing buffers) and
+// resync, like the devices.
+//
+//   cc -c -O2 -I../.. host_server.c ../../srpc.c ../../srpc_reactor.c
+//       ../../proto.c ../../lck.c ../../eh.c
+//   c++ -O2 -I. -I../.. -o host_server *.o ../../log.cpp -lpthread
+//
+//   host_server [-d] [-p port] [-r commands_per_sec] [-a activity_timeout]
+//               [-b ring_size] [-t seconds]
+//
+// Registration time (accept to REGISTER_DEVICE_C), command latency and
+// throughput are printed every second and summed up on exit.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "srpc.h"
+#include "srpc_reactor.h"
+
+// A command without the value reported back is given up after this time
+#define HOST_SERVER_COMMAND_TIMEOUT_US 5000000ULL
+
+int debug_mode = 0;
+int run_as_daemon = 0;
+
+typedef struct {
+  unsigned char number;
+  char value;  // value[0] last reported by the device
+
+  unsigned long long command_us;  // 0 - no command pending
+  char command_value;
+} THostServerChannel;
+
+typedef struct THostServer THostServer;
+typedef struct THostServerDevice THostServerDevice;
+
+struct THostServerDevice {
+  THostServer *server;
+  void *srpc;
+  unsigned long long accepted_us;
+  char registered;
+
+  int channel_count;  // relay channels only
+  int next_channel;
+  THostServerChannel channels[SUPLA_CHANNELMAXCOUNT];
+
+  THostServerDevice *prev;
+  THostServerDevice *next;
+};
+
+typedef struct {
+  unsigned int *us;
+  size_t count;
+  size_t size;
+} THostServerSamples;
+
+typedef struct {
+  unsigned int registered;
+  unsigned int pings;
+  unsigned int calls_in;
+  unsigned int calls_out;
+  unsigned int commands_sent;
+  unsigned int commands_done;
+  unsigned int commands_lost;
+  unsigned int commands_failed;
+  // Ticks that found every relay channel waiting for a previous command
+  unsigned int commands_busy;
+  THostServerSamples latency;
+} THostServerCounters;
+
+struct THostServer {
+  void *reactor;
+  int listen_fd;
+  int command_fd;
+  int report_fd;
+
+  unsigned char activity_timeout;
+  unsigned _supla_int_t ring_size;
+  _supla_int_t sender_id;
+
+  unsigned int device_count;
+  THostServerDevice *devices;
+  THostServerDevice *cursor;  // next device to get a command
+
+  unsigned long long start_us;
+  THostServerSamples registration;
+  THostServerCounters interval;
+  THostServerCounters total;
+};
+
+static volatile sig_atomic_t host_server_running = 1;
+
+static unsigned long long host_server_time_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void host_server_signal_handler(int sig) { host_server_running = 0; }
+
+static void host_server_sample_add(THostServerSamples *samples,
+                                   unsigned long long us) {
+  if (samples->count == samples->size) {
+    size_t size = samples->size ? samples->size * 2 : 1024;
+    unsigned int *data =
+        (unsigned int *)realloc(samples->us, size * sizeof(unsigned int));
+
+    if (data == NULL) {
+      return;
+    }
+
+    samples->us = data;
+    samples->size = size;
+  }
+
+  samples->us[samples->count++] = us > 0xFFFFFFFF ? 0xFFFFFFFF : us;
+}
+
+static int host_server_sample_cmp(const void *a, const void *b) {
+  unsigned int _a = *(const unsigned int *)a;
+  unsigned int _b = *(const unsigned int *)b;
+  return _a < _b ? -1 : (_a > _b ? 1 : 0);
+}
+
+// Sorts the samples and formats p50/p99/max in milliseconds
+static void host_server_sample_print(THostServerSamples *samples, char *buf,
+                                     size_t size) {
+  if (samples->count == 0) {
+    snprintf(buf, size, "-");
+    return;
+  }
+
+  qsort(samples->us, samples->count, sizeof(unsigned int),
+        host_server_sample_cmp);
+
+  snprintf(buf, size, "p50 %.2f p99 %.2f max %.2f ms",
+           samples->us[samples->count / 2] / 1000.0,
+           samples->us[samples->count * 99 / 100] / 1000.0,
+           samples->us[samples->count - 1] / 1000.0);
+}
+
+static THostServerChannel *host_server_channel(THostServerDevice *device,
+                                               unsigned char number) {
+  int a;
+
+  for (a = 0; a < device->channel_count; a++) {
+    if (device->channels[a].number == number) {
+      return &device->channels[a];
+    }
+  }
+
+  return NULL;
+}
+
+#define HOST_SERVER_COUNT(server, field) \
+  do {                                    \
+    (server)->interval.field++;           \
+    (server)->total.field++;              \
+  } while (0)
+
+static void host_server_on_register(THostServer *server,
+                                    THostServerDevice *device,
+                                    TDS_SuplaRegisterDevice_C *reg) {
+  TSD_SuplaRegisterDeviceResult result;
+  int a;
+
+  host_server_sample_add(&server->registration,
+                         host_server_time_us() - device->accepted_us);
+
+  device->channel_count = 0;
+
+  for (a = 0; a < reg->channel_count && a < SUPLA_CHANNELMAXCOUNT; a++) {
+    if (reg->channels[a].Type == SUPLA_CHANNELTYPE_RELAY) {
+      THostServerChannel *channel = &device->channels[device->channel_count++];
+      memset(channel, 0, sizeof(THostServerChannel));
+      channel->number = reg->channels[a].Number;
+      channel->value = reg->channels[a].value[0];
+    }
+  }
+
+  memset(&result, 0, sizeof(result));
+  result.result_code = SUPLA_RESULTCODE_TRUE;
+  result.activity_timeout = server->activity_timeout;
+  result.version = SUPLA_PROTO_VERSION;
+  result.version_min = SUPLA_PROTO_VERSION_MIN;
+
+  srpc_sd_async_registerdevice_result(device->srpc, &result);
+  HOST_SERVER_COUNT(server, calls_out);
+
+  device->registered = 1;
+  HOST_SERVER_COUNT(server, registered);
+
+  supla_log(LOG_DEBUG, "Registered %s, %i relay channel(s)", reg->Name,
+            device->channel_count);
+}
+
+static void host_server_on_value_changed(THostServer *server,
+                                         THostServerDevice *device,
+                                         TDS_SuplaDeviceChannelValue *value) {
+  THostServerChannel *channel =
+      host_server_channel(device, value->ChannelNumber);
+
+  if (channel == NULL) {
+    return;
+  }
+
+  channel->value = value->value[0];
+
+  if (channel->command_us != 0 && channel->value == channel->command_value) {
+    HOST_SERVER_COUNT(server, commands_done);
+
+    unsigned long long us = host_server_time_us() - channel->command_us;
+    host_server_sample_add(&server->interval.latency, us);
+    host_server_sample_add(&server->total.latency, us);
+
+    channel->command_us = 0;
+  }
+}
+
+static void host_server_on_call(void *_srpc, unsigned _supla_int_t rr_id,
+                                unsigned _supla_int_t call_type,
+                                void *user_params,
+                                unsigned char proto_version) {
+  THostServerDevice *device = (THostServerDevice *)user_params;
+  THostServer *server = device->server;
+  TsrpcReceivedData rd;
+
+  if (srpc_getdata(_srpc, &rd, rr_id) != SUPLA_RESULT_TRUE) {
+    return;
+  }
+
+  HOST_SERVER_COUNT(server, calls_in);
+
+  switch (rd.call_type) {
+    case SUPLA_DS_CALL_REGISTER_DEVICE_C:
+      host_server_on_register(server, device, rd.data.ds_register_device_c);
+      break;
+    case SUPLA_DCS_CALL_PING_SERVER:
+      srpc_sdc_async_ping_server_result(_srpc);
+      HOST_SERVER_COUNT(server, pings);
+      HOST_SERVER_COUNT(server, calls_out);
+      break;
+    case SUPLA_DCS_CALL_SET_ACTIVITY_TIMEOUT: {
+      TSDC_SuplaSetActivityTimeoutResult result;
+      result.min = 10;
+      result.max = 240;
+      result.activity_timeout =
+          rd.data.dcs_set_activity_timeout->activity_timeout;
+
+      if (result.activity_timeout < result.min) {
+        result.activity_timeout = result.min;
+      } else if (result.activity_timeout > result.max) {
+        result.activity_timeout = result.max;
+      }
+
+      srpc_dcs_async_set_activity_timeout_result(_srpc, &result);
+      HOST_SERVER_COUNT(server, calls_out);
+    } break;
+    case SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED:
+      if (device->registered) {
+        host_server_on_value_changed(server, device,
+                                     rd.data.ds_device_channel_value);
+      }
+      break;
+    case SUPLA_DS_CALL_CHANNEL_SET_VALUE_RESULT:
+      if (!rd.data.ds_channel_new_value_result->Success) {
+        THostServerChannel *channel = host_server_channel(
+            device, rd.data.ds_channel_new_value_result->ChannelNumber);
+
+        if (channel != NULL && channel->command_us != 0) {
+          channel->command_us = 0;
+          HOST_SERVER_COUNT(server, commands_failed);
+        }
+      }
+      break;
+    default:
+      supla_log(LOG_DEBUG, "Unhandled call %i", rd.call_type);
+      break;
+  }
+
+  srpc_rd_free(&rd);
+}
+
+// Sends one command to the next relay channel without one pending
+static void host_server_command(THostServer *server) {
+  THostServerDevice *device;
+  THostServerChannel *channel;
+  TSD_SuplaChannelNewValue value;
+  unsigned long long now = host_server_time_us();
+  unsigned int a;
+  char channels = 0;
+  int b;
+
+  for (a = 0; a < server->device_count; a++) {
+    if (server->cursor == NULL) {
+      server->cursor = server->devices;
+    }
+
+    device = server->cursor;
+    server->cursor = device->next;
+
+    if (!device->registered) {
+      continue;
+    }
+
+    for (b = 0; b < device->channel_count; b++) {
+      channels = 1;
+      channel = &device->channels[device->next_channel];
+      device->next_channel = (device->next_channel + 1) % device->channel_count;
+
+      if (channel->command_us != 0) {
+        if (now - channel->command_us < HOST_SERVER_COMMAND_TIMEOUT_US) {
+          continue;
+        }
+
+        HOST_SERVER_COUNT(server, commands_lost);
+      }
+
+      memset(&value, 0, sizeof(value));
+      value.SenderID = ++server->sender_id;
+      value.ChannelNumber = channel->number;
+      // The opposite of the current state, so the device reports a change
+      value.value[0] = channel->value ? 0 : 1;
+
+      if (srpc_sd_async_set_channel_value(device->srpc, &value) ==
+          SUPLA_RESULT_FALSE) {
+        return;
+      }
+
+      channel->command_us = now;
+      channel->command_value = value.value[0];
+
+      HOST_SERVER_COUNT(server, commands_sent);
+      HOST_SERVER_COUNT(server, calls_out);
+      return;
+    }
+  }
+
+  if (channels) {
+    HOST_SERVER_COUNT(server, commands_busy);
+  }
+}
+
+static void host_server_on_command_timer(void *reactor, int fd,
+                                         void *user_params) {
+  THostServer *server = (THostServer *)user_params;
+  unsigned long long expirations = 0;
+
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+
+  // Ticks missed while busy are made up for, the rate is kept on average
+  while (expirations--) {
+    host_server_command(server);
+  }
+}
+
+static void host_server_on_report_timer(void *reactor, int fd,
+                                        void *user_params) {
+  THostServer *server = (THostServer *)user_params;
+  THostServerCounters *c = &server->interval;
+  unsigned long long expirations;
+  char latency[64];
+
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+
+  host_server_sample_print(&c->latency, latency, sizeof(latency));
+
+  printf(
+      "devices %u registered %u | calls in %u out %u pings %u | commands "
+      "sent %u done %u lost %u busy %u | latency %s\n",
+      server->device_count, c->registered, c->calls_in, c->calls_out,
+      c->pings, c->commands_sent, c->commands_done, c->commands_lost,
+      c->commands_busy, latency);
+  fflush(stdout);
+
+  c->latency.count = 0;
+  memset(c, 0, offsetof(THostServerCounters, latency));
+}
+
+static void host_server_on_accept(void *reactor, int fd, void *user_params) {
+  THostServer *server = (THostServer *)user_params;
+  THostServerDevice *device;
+  TsrpcParams params;
+  int sfd, yes = 1;
+
+  while ((sfd = accept(fd, NULL, NULL)) != -1) {
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    device = (THostServerDevice *)malloc(sizeof(THostServerDevice));
+
+    if (device == NULL) {
+      close(sfd);
+      continue;
+    }
+
+    memset(device, 0, sizeof(THostServerDevice));
+    device->server = server;
+    device->accepted_us = host_server_time_us();
+
+    srpc_params_init(&params);
+    params.on_remote_call_received = &host_server_on_call;
+    params.user_params = device;
+    params.ring_buffer_size = server->ring_size;
+    params.resync = 1;
+
+    if ((device->srpc = srpc_reactor_add(reactor, sfd, &params)) == NULL) {
+      close(sfd);
+      free(device);
+      continue;
+    }
+
+    device->next = server->devices;
+
+    if (server->devices != NULL) {
+      server->devices->prev = device;
+    }
+
+    server->devices = device;
+    server->device_count++;
+  }
+}
+
+static void host_server_on_close(void *reactor, void *_srpc, int fd,
+                                 void *user_params) {
+  THostServerDevice *device = (THostServerDevice *)user_params;
+  THostServer *server = device->server;
+
+  if (debug_mode) {
+    srpc_log_summary(_srpc);
+  }
+
+  if (server->cursor == device) {
+    server->cursor = device->next;
+  }
+
+  if (device->prev != NULL) {
+    device->prev->next = device->next;
+  } else {
+    server->devices = device->next;
+  }
+
+  if (device->next != NULL) {
+    device->next->prev = device->prev;
+  }
+
+  server->device_count--;
+  free(device);
+}
+
+static int host_server_timer(THostServer *server, long long period_ns,
+                             _func_srpc_reactor_OnFdReady on_ready) {
+  struct itimerspec spec;
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_interval.tv_sec = period_ns / 1000000000LL;
+  spec.it_interval.tv_nsec = period_ns % 1000000000LL;
+  spec.it_value = spec.it_interval;
+
+  if (timerfd_settime(fd, 0, &spec, NULL) == -1 ||
+      srpc_reactor_watch(server->reactor, fd, on_ready, server) ==
+          SUPLA_RESULT_FALSE) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int host_server_listen(THostServer *server, int port) {
+  struct sockaddr_in addr;
+  int fd, yes = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, SOMAXCONN) == -1 ||
+      srpc_reactor_watch(server->reactor, fd, host_server_on_accept,
+                         server) == SUPLA_RESULT_FALSE) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void host_server_summary(THostServer *server) {
+  THostServerCounters *c = &server->total;
+  double secs = (host_server_time_us() - server->start_us) / 1000000.0;
+  char registration[64], latency[64];
+
+  host_server_sample_print(&server->registration, registration,
+                           sizeof(registration));
+  host_server_sample_print(&c->latency, latency, sizeof(latency));
+
+  printf("\n%.1f s, %u device(s) registered, registration %s\n", secs,
+         c->registered, registration);
+  printf("calls in %u out %u, pings %u\n", c->calls_in, c->calls_out,
+         c->pings);
+  printf(
+      "commands sent %u done %u (%.1f/s) lost %u failed %u busy %u, latency "
+      "%s\n",
+      c->commands_sent, c->commands_done, secs > 0 ? c->commands_done / secs : 0,
+      c->commands_lost, c->commands_failed, c->commands_busy, latency);
+}
+
+int main(int argc, char **argv) {
+  THostServer server;
+  struct sigaction sa;
+  int port = 2015;
+  double rate = 10;
+  int seconds = 0;
+  int activity_timeout = 30;
+  int ring_size = 32768;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "dp:r:a:b:t:")) != -1) {
+    switch (opt) {
+      case 'd':
+        debug_mode = 1;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      case 'a':
+        activity_timeout = atoi(optarg);
+        break;
+      case 'b':
+        ring_size = atoi(optarg);
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-d] [-p port] [-r commands_per_sec] "
+                "[-a activity_timeout] [-b ring_size] [-t seconds]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  if (ring_size < 0 ||
+      (ring_size > 0 && (unsigned int)ring_size < SPROTO_RING_MIN_SIZE)) {
+    fprintf(stderr, "ring_size has to be 0 or at least %u\n",
+            (unsigned int)SPROTO_RING_MIN_SIZE);
+    return 1;
+  }
+
+  memset(&server, 0, sizeof(server));
+  server.activity_timeout = activity_timeout;
+  server.ring_size = ring_size;
+  server.command_fd = -1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = host_server_signal_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  server.reactor = srpc_reactor_init(host_server_on_close);
+
+  if (server.reactor == NULL) {
+    return 1;
+  }
+
+  if ((server.listen_fd = host_server_listen(&server, port)) == -1) {
+    fprintf(stderr, "Can't listen on 127.0.0.1:%i: %s\n", port,
+            strerror(errno));
+    srpc_reactor_free(server.reactor);
+    return 1;
+  }
+
+  server.report_fd =
+      host_server_timer(&server, 1000000000LL, host_server_on_report_timer);
+
+  if (rate > 0) {
+    server.command_fd = host_server_timer(&server, 1000000000LL / rate,
+                                          host_server_on_command_timer);
+  }
+
+  printf("Listening on 127.0.0.1:%i, %.1f command(s)/s, ring %u\n", port, rate,
+         server.ring_size);
+  fflush(stdout);
+
+  server.start_us = host_server_time_us();
+
+  while (host_server_running &&
+         (seconds == 0 ||
+          host_server_time_us() - server.start_us < seconds * 1000000ULL)) {
+    if (srpc_reactor_run(server.reactor, 100) == -1) {
+      break;
+    }
+  }
+
+  host_server_summary(&server);
+
+  srpc_reactor_unwatch(server.reactor, server.listen_fd);
+  close(server.listen_fd);
+
+  if (server.report_fd != -1) {
+    srpc_reactor_unwatch(server.reactor, server.report_fd);
+    close(server.report_fd);
+  }
+
+  if (server.command_fd != -1) {
+    srpc_reactor_unwatch(server.reactor, server.command_fd);
+    close(server.command_fd);
+  }
+
+  srpc_reactor_free(server.reactor);
+
+  free(server.registration.us);
+  free(server.interval.latency.us);
+  free(server.total.latency.us);
+
+  return 0;
+}
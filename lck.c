@@ -26,42 +26,173 @@
 #include <Windows.h>
 #else
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #endif /*_WIN32*/
 
 #endif /*defined(__AVR__) || defined(ARDUINO_ARCH_ESP8266)*/
 
 #include <stdlib.h>
+#include <string.h>
 
 #define MUTEX_COUNT 4
 
+#ifndef LCK_DEFAULT_POLICY
+#define LCK_DEFAULT_POLICY LCK_POLICY_RECURSIVE
+#endif /*LCK_DEFAULT_POLICY*/
+
+// Spins before the thread yields to the one holding the lock
+#ifndef LCK_SPIN_COUNT
+#define LCK_SPIN_COUNT 128
+#endif /*LCK_SPIN_COUNT*/
+
 #ifndef __SINGLE_THREAD
 
 typedef struct {
+  unsigned char policy;
 #ifdef _WIN32
   CRITICAL_SECTION critSec;
+  volatile LONG spin;
 #else
   pthread_mutex_t mutex;
+  int spin;
 #endif /*_WIN32*/
+
+#ifdef LCK_STATS
+  TLckStats stats;
+  unsigned int depth;
+  unsigned long long lock_time;
+#endif /*LCK_STATS*/
 } TLckData;
-#endif
 
-void *lck_init(void) {
+#ifdef LCK_STATS
+static unsigned long long lck_time_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+         (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ULL /
+             freq.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif /*_WIN32*/
+}
+#endif /*LCK_STATS*/
+
+static char lck_spin_trylock(TLckData *lck) {
+#ifdef _WIN32
+  return InterlockedExchange(&lck->spin, 1) == 0;
+#else
+  return __atomic_exchange_n(&lck->spin, 1, __ATOMIC_ACQUIRE) == 0;
+#endif /*_WIN32*/
+}
+
+static void lck_spin_lock(TLckData *lck) {
+  int n = 0;
+
+  while (!lck_spin_trylock(lck)) {
+    // Wait on a plain read, so the cache line isn't bounced by the exchange
+#ifdef _WIN32
+    while (lck->spin) {
+      if (++n >= LCK_SPIN_COUNT) {
+        n = 0;
+        SwitchToThread();
+      }
+    }
+#else
+    while (__atomic_load_n(&lck->spin, __ATOMIC_RELAXED)) {
+      if (++n >= LCK_SPIN_COUNT) {
+        n = 0;
+        sched_yield();
+      }
+    }
+#endif /*_WIN32*/
+  }
+}
+
+static void lck_spin_unlock(TLckData *lck) {
+#ifdef _WIN32
+  InterlockedExchange(&lck->spin, 0);
+#else
+  __atomic_store_n(&lck->spin, 0, __ATOMIC_RELEASE);
+#endif /*_WIN32*/
+}
+
+// Returns 1 if the lock had to be waited for
+static char lck_acquire(TLckData *lck) {
+  switch (lck->policy) {
+    case LCK_POLICY_NONE:
+      return 0;
+    case LCK_POLICY_SPIN:
+      if (lck_spin_trylock(lck)) return 0;
+      lck_spin_lock(lck);
+      return 1;
+  }
+
+#ifdef _WIN32
+  if (TryEnterCriticalSection(&lck->critSec)) return 0;  // NOLINT
+  EnterCriticalSection(&lck->critSec);                   // NOLINT
+#else
+  if (pthread_mutex_trylock(&lck->mutex) == 0) return 0;  // NOLINT
+  pthread_mutex_lock(&lck->mutex);                        // NOLINT
+#endif /*_WIN32*/
+
+  return 1;
+}
+
+static void lck_release(TLckData *lck) {
+  switch (lck->policy) {
+    case LCK_POLICY_NONE:
+      return;
+    case LCK_POLICY_SPIN:
+      lck_spin_unlock(lck);
+      return;
+  }
+
+#ifdef _WIN32
+  LeaveCriticalSection(&lck->critSec);  // NOLINT
+#else
+  pthread_mutex_unlock(&lck->mutex);  // NOLINT
+#endif /*_WIN32*/
+}
+
+#endif /*__SINGLE_THREAD*/
+
+void *lck_init(void) { return lck_init_policy(LCK_POLICY_DEFAULT); }
+
+void *lck_init_policy(unsigned char policy) {
 #ifdef __SINGLE_THREAD
   return NULL;
 #else
   TLckData *lck = malloc(sizeof(TLckData));
 
   if (lck != NULL) {
+    memset(lck, 0, sizeof(TLckData));
+
+    if (policy == LCK_POLICY_DEFAULT) {
+      policy = LCK_DEFAULT_POLICY;
+    }
+
+    lck->policy = policy;
+
 #ifdef _WIN32
+    // Critical sections are always recursive
     InitializeCriticalSectionEx(&lck->critSec, 4000,
                                 CRITICAL_SECTION_NO_DEBUG_INFO);
 #else
 
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+    if (policy == LCK_POLICY_RECURSIVE) {
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    }
+
     pthread_mutex_init(&lck->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
 
 #endif /*_WIN32*/
   }
@@ -73,11 +204,21 @@ void *lck_init(void) {
 void lck_lock(void *lck) {
 #ifndef __SINGLE_THREAD
   if (lck != NULL) {
-#ifdef _WIN32
-    EnterCriticalSection(&((TLckData *)lck)->critSec); // NOLINT
+#ifdef LCK_STATS
+    TLckData *l = (TLckData *)lck;
+
+    if (lck_acquire(l)) {
+      l->stats.contended++;
+    }
+
+    l->stats.acquired++;
+
+    if (l->depth++ == 0) {
+      l->lock_time = lck_time_ns();
+    }
 #else
-    pthread_mutex_lock(&((TLckData *)lck)->mutex); // NOLINT
-#endif /*_WIN32*/
+    lck_acquire((TLckData *)lck);
+#endif /*LCK_STATS*/
   }
 
 #endif /*__SINGLE_THREAD*/
@@ -86,11 +227,20 @@ void lck_lock(void *lck) {
 void lck_unlock(void *lck) {
 #ifndef __SINGLE_THREAD
   if (lck != NULL) {
-#ifdef _WIN32
-    LeaveCriticalSection(&((TLckData *)lck)->critSec); // NOLINT
-#else
-    pthread_mutex_unlock(&((TLckData *)lck)->mutex); // NOLINT
-#endif /*_WIN32*/
+#ifdef LCK_STATS
+    TLckData *l = (TLckData *)lck;
+    unsigned long long hold_time;
+
+    if (l->depth > 0 && --l->depth == 0) {
+      hold_time = lck_time_ns() - l->lock_time;
+      l->stats.hold_time_ns += hold_time;
+
+      if (hold_time > l->stats.max_hold_time_ns) {
+        l->stats.max_hold_time_ns = hold_time;
+      }
+    }
+#endif /*LCK_STATS*/
+    lck_release((TLckData *)lck);
   }
 
 #endif /*__SINGLE_THREAD*/
@@ -115,3 +265,15 @@ void lck_free(void *lck) {
   }
 #endif /*__SINGLE_THREAD*/
 }
+
+void lck_get_stats(void *lck, TLckStats *stats) {
+  memset(stats, 0, sizeof(TLckStats));
+
+#if !defined(__SINGLE_THREAD) && defined(LCK_STATS)
+  if (lck != NULL) {
+    lck_acquire((TLckData *)lck);
+    memcpy(stats, &((TLckData *)lck)->stats, sizeof(TLckStats));
+    lck_release((TLckData *)lck);
+  }
+#endif /*!defined(__SINGLE_THREAD) && defined(LCK_STATS)*/
+}
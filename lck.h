@@ -23,12 +23,28 @@
 extern "C" {
 #endif
 
+#define LCK_POLICY_DEFAULT 0    // LCK_DEFAULT_POLICY of the build
+#define LCK_POLICY_RECURSIVE 1  // recursive mutex
+#define LCK_POLICY_NONE 2       // no locking, single threaded programs only
+#define LCK_POLICY_SPIN 3       // adaptive spin, for short critical sections
+#define LCK_POLICY_MUTEX 4      // plain mutex, not recursive
+
+// Collected only when built with LCK_STATS
+typedef struct {
+  unsigned long long acquired;
+  unsigned long long contended;  // the lock was held by another thread
+  unsigned long long hold_time_ns;  // outermost lock to unlock, in total
+  unsigned long long max_hold_time_ns;
+} TLckStats;
+
 void *lck_init(void);
+void *lck_init_policy(unsigned char policy);
 void lck_lock(void *lck);
 char lck_lock_with_timeout(void *lck, int timeout_sec);
 void lck_unlock(void *lck);
 int lck_unlock_r(void *lck, int result);
 void lck_free(void *lck);
+void lck_get_stats(void *lck, TLckStats *stats);
 
 #ifdef __cplusplus
 }
@@ -18,6 +18,8 @@
 
 #include "proto.h"
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "log.h"
@@ -53,25 +55,36 @@
 static char sproto_tag[SUPLA_TAG_SIZE] = {'S', 'U', 'P', 'L', 'A'};
 
 typedef struct {
-  unsigned char begin_tag;
+  unsigned char begin_tag;  // in buffer only
   unsigned _supla_int_t size;
   unsigned _supla_int_t data_size;
+  unsigned _supla_int_t head;  // ring mode only, index of the first data byte
 
   char *buffer;
-} TSuplaProtoInBuffer;
+#ifdef SPROTO_STATS
+  TSuplaProtoBufferStats stats;
+#endif /*SPROTO_STATS*/
+} TSuplaProtoBuffer;
 
-typedef struct {
-  unsigned _supla_int_t size;
-  unsigned _supla_int_t data_size;
-
-  char *buffer;
-} TSuplaProtoOutBuffer;
+#ifdef SPROTO_STATS
+#define SPROTO_STATS_INC(b, field) (b)->stats.field++
+#else
+#define SPROTO_STATS_INC(b, field)
+#endif /*SPROTO_STATS*/
 
 typedef struct {
   unsigned _supla_int_t next_rr_id;
   unsigned char version;
-  TSuplaProtoInBuffer in;
-  TSuplaProtoOutBuffer out;
+  unsigned char ring;
+  unsigned char resync;
+  unsigned char resync_pending;  // no valid packet since the last resync
+  unsigned _supla_int_t view_size;  // in bytes held by the borrowed view
+  TSuplaProtoBuffer in;
+  TSuplaProtoBuffer out;
+#ifdef SPROTO_STATS
+  unsigned _supla_int_t resync_count;
+  unsigned _supla_int_t resync_discarded;
+#endif /*SPROTO_STATS*/
 } TSuplaProtoData;
 
 void *sproto_init(void) {
@@ -85,6 +98,37 @@ void *sproto_init(void) {
   return (NULL);
 }
 
+void *sproto_init_ring(unsigned _supla_int_t in_size,
+                       unsigned _supla_int_t out_size) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)sproto_init();
+
+  if (spd == NULL || in_size < SPROTO_RING_MIN_SIZE ||
+      out_size < SPROTO_RING_MIN_SIZE) {
+    sproto_free(spd);
+    return (NULL);
+  }
+
+  spd->ring = 1;
+  // The tail behind the in ring lets a wrapped payload be viewed contiguously
+  spd->in.buffer = (char *)malloc(in_size + SUPLA_MAX_DATA_SIZE);
+  spd->out.buffer = (char *)malloc(out_size);
+
+  if (spd->in.buffer == NULL || spd->out.buffer == NULL) {
+    sproto_free(spd);
+    return (NULL);
+  }
+
+  spd->in.size = in_size;
+  spd->out.size = out_size;
+
+#ifdef SPROTO_STATS
+  spd->in.stats.max_size = in_size;
+  spd->out.stats.max_size = out_size;
+#endif /*SPROTO_STATS*/
+
+  return (spd);
+}
+
 void sproto_free(void *spd_ptr) {
   TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
   if (spd != NULL) {
@@ -95,52 +139,173 @@ void sproto_free(void *spd_ptr) {
   }
 }
 
-unsigned char sproto_buffer_append(void *spd_ptr, char **buffer,
-                                   unsigned _supla_int_t *buffer_size,
-                                   unsigned _supla_int_t *buffer_data_size,
-                                   char *data,
-                                   unsigned _supla_int_t data_size) {
-  unsigned _supla_int_t size = *buffer_size;
+// Offsets passed to the functions below are relative to the first data byte.
+// In the dynamic mode head is always 0, so the same code serves both modes.
+
+static unsigned _supla_int_t sproto_buffer_idx(TSuplaProtoBuffer *b,
+                                               unsigned _supla_int_t offset) {
+  offset += b->head;
+  return offset >= b->size ? offset - b->size : offset;
+}
+
+static unsigned _supla_int_t sproto_buffer_span(TSuplaProtoBuffer *b,
+                                                unsigned _supla_int_t offset,
+                                                unsigned _supla_int_t size,
+                                                char **span) {
+  unsigned _supla_int_t idx = sproto_buffer_idx(b, offset);
+
+  if (size > b->size - idx) size = b->size - idx;
+
+  *span = &b->buffer[idx];
+  return size;
+}
+
+static void sproto_buffer_read(TSuplaProtoBuffer *b,
+                               unsigned _supla_int_t offset, char *dst,
+                               unsigned _supla_int_t size) {
+  char *span;
+  unsigned _supla_int_t n = sproto_buffer_span(b, offset, size, &span);
+
+  memcpy(dst, span, n);
+  if (n < size) memcpy(&dst[n], b->buffer, size - n);
+}
+
+static void sproto_buffer_write(TSuplaProtoBuffer *b,
+                                unsigned _supla_int_t offset, const char *src,
+                                unsigned _supla_int_t size) {
+  char *span;
+  unsigned _supla_int_t n = sproto_buffer_span(b, offset, size, &span);
+
+  memcpy(span, src, n);
+  if (n < size) memcpy(b->buffer, &src[n], size - n);
+}
+
+// To be called whenever data_size grows
+static void sproto_buffer_filled(TSuplaProtoBuffer *b) {
+#ifdef SPROTO_STATS
+  if (b->data_size > b->stats.max_data_size) {
+    b->stats.max_data_size = b->data_size;
+  }
+#endif /*SPROTO_STATS*/
+}
+
+static char sproto_buffer_reserve(TSuplaProtoData *spd, TSuplaProtoBuffer *b,
+                                  unsigned _supla_int_t data_size) {
+  unsigned _supla_int_t size = b->size;
+
+  if (spd->ring) {
+    if (data_size > b->size - b->data_size) {
+      SPROTO_STATS_INC(b, overflow_count);
+      return SUPLA_RESULT_BUFFER_OVERFLOW;
+    }
+
+    return SUPLA_RESULT_TRUE;
+  }
 
   if (size < BUFFER_MIN_SIZE) {
     size = BUFFER_MIN_SIZE;
   }
 
-  if (data_size > size - (*buffer_data_size)) {
-    size += data_size - (size - (*buffer_data_size));
+  if (data_size > size - b->data_size) {
+    size += data_size - (size - b->data_size);
   }
 
-  if (size >= BUFFER_MAX_SIZE) return (SUPLA_RESULT_BUFFER_OVERFLOW);
+  if (size >= BUFFER_MAX_SIZE) {
+    SPROTO_STATS_INC(b, overflow_count);
+    return (SUPLA_RESULT_BUFFER_OVERFLOW);
+  }
 
-  if (size != (*buffer_size)) {
-    char *new_buffer = (char *)realloc(*buffer, size);
+  if (size != b->size) {
+    char *new_buffer = (char *)realloc(b->buffer, size);
 
     if (size > 0 && new_buffer == NULL) {
       return (SUPLA_RESULT_FALSE);
     }
 
+    b->buffer = new_buffer;
+    b->size = size;
+
+#ifdef SPROTO_STATS
+    b->stats.grow_count++;
+
+    if (size > b->stats.max_size) {
+      b->stats.max_size = size;
+    }
+#endif /*SPROTO_STATS*/
+
 #ifndef ESP8266
 #ifndef __AVR__
     if (errno == ENOMEM) return (SUPLA_RESULT_FALSE);
 #endif
 #endif
+  }
+
+  return (SUPLA_RESULT_TRUE);
+}
+
+static void sproto_buffer_consume(TSuplaProtoData *spd, TSuplaProtoBuffer *b,
+                                  unsigned _supla_int_t size) {
+  unsigned _supla_int_t old_size = b->size;
+
+  if (size > b->data_size) size = b->data_size;
 
-    *buffer = new_buffer;
+  b->data_size -= size;
+
+  if (spd->ring) {
+    b->head = b->data_size == 0 ? 0 : sproto_buffer_idx(b, size);
+    return;
   }
 
-  memcpy(&(*buffer)[(*buffer_data_size)], data, data_size);
+  if (b->data_size > 0) {
+    memmove(b->buffer, &b->buffer[size], b->data_size);
+  }
 
-  (*buffer_size) = size;
-  (*buffer_data_size) += data_size;
+  if (b->data_size < b->size) {
+    b->size = b->data_size;
 
-  return (SUPLA_RESULT_TRUE);
+    if (b->size < BUFFER_MIN_SIZE) b->size = BUFFER_MIN_SIZE;
+
+    if (old_size != b->size) {
+      char *new_buffer = (char *)realloc(b->buffer, b->size);
+
+      if (new_buffer == NULL && b->size > 0) {
+        b->size = old_size;
+      } else {
+        b->buffer = new_buffer;
+        SPROTO_STATS_INC(b, shrink_count);
+      }
+    }
+  }
 }
 
 char sproto_in_buffer_append(void *spd_ptr, char *data,
                              unsigned _supla_int_t data_size) {
   TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
-  return sproto_buffer_append(spd_ptr, &spd->in.buffer, &spd->in.size,
-                              &spd->in.data_size, data, data_size);
+  char result;
+
+  sproto_in_release_view(spd);
+  result = sproto_buffer_reserve(spd, &spd->in, data_size);
+
+  if (result == SUPLA_RESULT_TRUE && data_size > 0) {
+    sproto_buffer_write(&spd->in, spd->in.data_size, data, data_size);
+    spd->in.data_size += data_size;
+    sproto_buffer_filled(&spd->in);
+  }
+
+  return result;
+}
+
+char sproto_in_buffer_commit(void *spd_ptr, unsigned _supla_int_t size) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+
+  if (spd->ring == 0 || size > spd->in.size - spd->in.data_size) {
+    SPROTO_STATS_INC(&spd->in, overflow_count);
+    return SUPLA_RESULT_BUFFER_OVERFLOW;
+  }
+
+  spd->in.data_size += size;
+  sproto_buffer_filled(&spd->in);
+  return SUPLA_RESULT_TRUE;
 }
 
 char sproto_out_buffer_append(void *spd_ptr, TSuplaDataPacket *sdp) {
@@ -148,61 +313,116 @@ char sproto_out_buffer_append(void *spd_ptr, TSuplaDataPacket *sdp) {
   unsigned _supla_int_t sdp_size = sizeof(TSuplaDataPacket);
   unsigned _supla_int_t packet_size =
       sdp_size - SUPLA_MAX_DATA_SIZE + sdp->data_size;
+  char result;
 
   if (packet_size + SUPLA_TAG_SIZE > sdp_size)
     return SUPLA_RESULT_DATA_TOO_LARGE;
 
-  if (SUPLA_RESULT_TRUE ==
-      sproto_buffer_append(spd_ptr, &spd->out.buffer, &spd->out.size,
-                           &spd->out.data_size, (char *)sdp, packet_size)) {
-    return sproto_buffer_append(spd_ptr, &spd->out.buffer, &spd->out.size,
-                                &spd->out.data_size, sproto_tag,
-                                SUPLA_TAG_SIZE);
+  result = sproto_buffer_reserve(spd, &spd->out, packet_size + SUPLA_TAG_SIZE);
+
+  if (result == SUPLA_RESULT_TRUE) {
+    sproto_buffer_write(&spd->out, spd->out.data_size, (char *)sdp,
+                        packet_size);
+    sproto_buffer_write(&spd->out, spd->out.data_size + packet_size,
+                        sproto_tag, SUPLA_TAG_SIZE);
+    spd->out.data_size += packet_size + SUPLA_TAG_SIZE;
+    sproto_buffer_filled(&spd->out);
   }
 
-  return (SUPLA_RESULT_FALSE);
+  return result;
 }
 
-unsigned _supla_int_t sproto_pop_out_data(void *spd_ptr, char *buffer,
-                                          unsigned _supla_int_t buffer_size) {
-  unsigned _supla_int_t a;
-  unsigned _supla_int_t b;
+TSuplaDataPacket *sproto_out_buffer_reserve(void *spd_ptr,
+                                            unsigned _supla_int_t data_size) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t size = sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE +
+                               data_size + SUPLA_TAG_SIZE;
+  char *span;
+
+  if (size > sizeof(TSuplaDataPacket) ||
+      sproto_buffer_reserve(spd, &spd->out, size) != SUPLA_RESULT_TRUE ||
+      sproto_buffer_span(&spd->out, spd->out.data_size, size, &span) < size) {
+    return NULL;
+  }
+
+  return (TSuplaDataPacket *)span;
+}
+
+void sproto_out_buffer_commit(void *spd_ptr, TSuplaDataPacket *sdp) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t packet_size =
+      sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE + sdp->data_size;
+
+  memcpy(&((char *)sdp)[packet_size], sproto_tag, SUPLA_TAG_SIZE);
+  spd->out.data_size += packet_size + SUPLA_TAG_SIZE;
+  sproto_buffer_filled(&spd->out);
+}
 
+unsigned _supla_int_t sproto_out_data_peek(void *spd_ptr, char *buffer,
+                                           unsigned _supla_int_t buffer_size) {
   TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
 
   if (spd->out.data_size <= 0 || buffer_size == 0 || buffer == NULL) return (0);
 
   if (spd->out.data_size < buffer_size) buffer_size = spd->out.data_size;
 
-  memcpy(buffer, spd->out.buffer, buffer_size);
+  sproto_buffer_read(&spd->out, 0, buffer, buffer_size);
 
-  b = 0;
+  return (buffer_size);
+}
 
-  for (a = buffer_size; a < spd->out.data_size; a++) {
-    spd->out.buffer[b] = spd->out.buffer[a];
-    b++;
-  }
+void sproto_out_consume(void *spd_ptr, unsigned _supla_int_t size) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  sproto_buffer_consume(spd, &spd->out, size);
+}
 
-  spd->out.data_size -= buffer_size;
+unsigned _supla_int_t sproto_pop_out_data(void *spd_ptr, char *buffer,
+                                          unsigned _supla_int_t buffer_size) {
+  buffer_size = sproto_out_data_peek(spd_ptr, buffer, buffer_size);
+  sproto_out_consume(spd_ptr, buffer_size);
 
-  if (spd->out.data_size < spd->out.size) {
-    b = spd->out.size;
+  return (buffer_size);
+}
 
-    spd->out.size = spd->out.data_size;
-    if (spd->out.size < BUFFER_MIN_SIZE) spd->out.size = BUFFER_MIN_SIZE;
+unsigned _supla_int_t sproto_out_data_span(void *spd_ptr, char **span) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
 
-    if (b != spd->out.size) {
-      char *new_out_buffer = (char *)realloc(spd->out.buffer, spd->out.size);
+  if (spd->out.data_size == 0) return 0;
 
-      if (new_out_buffer == NULL && spd->out.size > 0) {
-        spd->out.size = b;
-      } else {
-        spd->out.buffer = new_out_buffer;
-      }
-    }
-  }
+  return sproto_buffer_span(&spd->out, 0, spd->out.data_size, span);
+}
 
-  return (buffer_size);
+unsigned char sproto_out_data_spans(void *spd_ptr,
+                                    unsigned _supla_int_t max_size,
+                                    char *span[2],
+                                    unsigned _supla_int_t span_size[2]) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t size = spd->out.data_size;
+
+  if (size > max_size) size = max_size;
+
+  if (size == 0) return 0;
+
+  span_size[0] = sproto_buffer_span(&spd->out, 0, size, &span[0]);
+
+  if (span_size[0] == size) return 1;
+
+  // A ring wraps around at most once
+  span[1] = spd->out.buffer;
+  span_size[1] = size - span_size[0];
+
+  return 2;
+}
+
+unsigned _supla_int_t sproto_in_free_span(void *spd_ptr, char **span) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+
+  sproto_in_release_view(spd);
+
+  if (spd->ring == 0 || spd->in.data_size == spd->in.size) return 0;
+
+  return sproto_buffer_span(&spd->in, spd->in.data_size,
+                            spd->in.size - spd->in.data_size, span);
 }
 
 char sproto_out_dataexists(void *spd_ptr) {
@@ -210,100 +430,236 @@ char sproto_out_dataexists(void *spd_ptr) {
                                                          : SUPLA_RESULT_FALSE;
 }
 
+unsigned _supla_int_t sproto_out_data_size(void *spd_ptr) {
+  return ((TSuplaProtoData *)spd_ptr)->out.data_size;
+}
+
 char sproto_in_dataexists(void *spd_ptr) {
-  return ((TSuplaProtoData *)spd_ptr)->in.data_size > 0 ? SUPLA_RESULT_TRUE
-                                                        : SUPLA_RESULT_FALSE;
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  return spd->in.data_size > spd->view_size ? SUPLA_RESULT_TRUE
+                                            : SUPLA_RESULT_FALSE;
 }
 
-void sproto_shrink_in_buffer(TSuplaProtoInBuffer *in,
+void sproto_shrink_in_buffer(TSuplaProtoData *spd,
                              unsigned _supla_int_t size) {
-  unsigned _supla_int_t old_size = in->size;
-  _supla_int_t a, b;
+  spd->in.begin_tag = 0;
+  sproto_buffer_consume(spd, &spd->in, size);
+}
 
-  in->begin_tag = 0;
+void sproto_in_release_view(void *spd_ptr) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
 
-  if (size > in->data_size) size = in->data_size;
+  if (spd->view_size > 0) {
+    sproto_shrink_in_buffer(spd, spd->view_size);
+    spd->view_size = 0;
+  }
+}
 
-  b = 0;
+static char sproto_is_tag(const char *data) {
+  uint32_t a, b;
 
-  for (a = size; a < in->data_size; a++) {
-    in->buffer[b] = in->buffer[a];
-    b++;
-  }
+  memcpy(&a, data, sizeof(uint32_t));
+  memcpy(&b, sproto_tag, sizeof(uint32_t));
 
-  in->data_size -= size;
+  return a == b && data[4] == sproto_tag[4];
+}
 
-  if (in->data_size < in->size) {
-    in->size = in->data_size;
+char sproto_in_packetexists(void *spd_ptr) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t header_size =
+      sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE;
+  unsigned _supla_int_t size = spd->in.data_size - spd->view_size;
+  unsigned _supla_int_t data_size;
+  char tag[SUPLA_TAG_SIZE];
 
-    if (in->size < BUFFER_MIN_SIZE) in->size = BUFFER_MIN_SIZE;
+  if (size < SUPLA_TAG_SIZE) return SUPLA_RESULT_FALSE;
 
-    if (old_size != in->size) {
-      char *new_in_buffer = (char *)realloc(in->buffer, in->size);
+  sproto_buffer_read(&spd->in, spd->view_size, tag, SUPLA_TAG_SIZE);
 
-      if (new_in_buffer == NULL && in->size > 0) {
-        in->size = old_size;
-      } else {
-        in->buffer = new_in_buffer;
-      }
+  if (!sproto_is_tag(tag)) return SUPLA_RESULT_TRUE;
+
+  if (size < header_size) return SUPLA_RESULT_FALSE;
+
+  sproto_buffer_read(&spd->in,
+                     spd->view_size + offsetof(TSuplaDataPacket, data_size),
+                     (char *)&data_size, sizeof(data_size));
+
+  return data_size > SUPLA_MAX_DATA_SIZE ||
+                 size >= header_size + data_size + SUPLA_TAG_SIZE
+             ? SUPLA_RESULT_TRUE
+             : SUPLA_RESULT_FALSE;
+}
+
+// Drops everything in front of the first tag found at or after offset. A tag
+// cut by the end of the received data is kept until the rest of it arrives.
+static void sproto_resync(TSuplaProtoData *spd, unsigned _supla_int_t offset) {
+  unsigned _supla_int_t n;
+  char tag[SUPLA_TAG_SIZE];
+  char *span;
+  char *p;
+
+  while (offset < spd->in.data_size) {
+    n = sproto_buffer_span(&spd->in, offset, spd->in.data_size - offset, &span);
+    p = (char *)memchr(span, sproto_tag[0], n);
+
+    if (p == NULL) {
+      offset += n;
+      continue;
+    }
+
+    offset += p - span;
+
+    if (spd->in.data_size - offset < SUPLA_TAG_SIZE) break;
+
+    if (p + SUPLA_TAG_SIZE > span + n) {
+      sproto_buffer_read(&spd->in, offset, tag, SUPLA_TAG_SIZE);
+      p = tag;
     }
+
+    if (sproto_is_tag(p)) break;
+
+    offset++;
   }
+
+#ifdef SPROTO_STATS
+  spd->resync_count++;
+  spd->resync_discarded += offset;
+#endif /*SPROTO_STATS*/
+
+  sproto_shrink_in_buffer(spd, offset);
 }
 
-char sproto_pop_in_sdp(void *spd_ptr, TSuplaDataPacket *sdp) {
+// Returns 1 when the parser should continue after a broken packet
+static char sproto_drop_broken_packet(TSuplaProtoData *spd) {
+  if (spd->resync) {
+    spd->resync_pending = 1;
+    sproto_resync(spd, 1);
+    return 1;
+  }
+
+  sproto_shrink_in_buffer(spd, spd->in.data_size);
+  return 0;
+}
+
+#define SPROTO_HEADER_FIELD(dst, header, field)                 \
+  memcpy(&(dst), &(header)[offsetof(TSuplaDataPacket, field)], \
+         sizeof(dst))
+
+// Validates the packet at the front of the in buffer and copies its header
+// to view. The packet stays in the buffer.
+static char sproto_in_next_packet(TSuplaProtoData *spd,
+                                  TSuplaDataPacketView *view) {
   unsigned _supla_int_t header_size;
-  TSuplaDataPacket *_sdp;
+  char header[sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE];
+  char tag[SUPLA_TAG_SIZE];
+
+  header_size = sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE;
+
+  while (1) {
+    if (spd->in.begin_tag == 0 && spd->in.data_size >= SUPLA_TAG_SIZE) {
+      sproto_buffer_read(&spd->in, 0, tag, SUPLA_TAG_SIZE);
+      if (sproto_is_tag(tag)) {
+        spd->in.begin_tag = 1;
+      } else if (sproto_drop_broken_packet(spd)) {
+        continue;
+      } else {
+        return SUPLA_RESULT_DATA_ERROR;
+      }
+    }
 
-  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+    if (spd->in.begin_tag != 1 ||
+        (spd->in.data_size - SUPLA_TAG_SIZE) < header_size) {
+      return SUPLA_RESULT_FALSE;
+    }
+
+    sproto_buffer_read(&spd->in, 0, header, header_size);
+    SPROTO_HEADER_FIELD(view->version, header, version);
+    SPROTO_HEADER_FIELD(view->rr_id, header, rr_id);
+    SPROTO_HEADER_FIELD(view->call_type, header, call_type);
+    SPROTO_HEADER_FIELD(view->data_size, header, data_size);
+
+    if (view->version > SUPLA_PROTO_VERSION ||
+        view->version < SUPLA_PROTO_VERSION_MIN) {
+      // Right after a resync the tag is more likely to be a false positive
+      if (spd->resync_pending && sproto_drop_broken_packet(spd)) continue;
+
+      sproto_shrink_in_buffer(spd, spd->in.data_size);
+
+      return SUPLA_RESULT_VERSION_ERROR;
+    }
+
+    if ((header_size + view->data_size + SUPLA_TAG_SIZE) >
+        sizeof(TSuplaDataPacket)) {
+      if (sproto_drop_broken_packet(spd)) continue;
+      return SUPLA_RESULT_DATA_ERROR;
+    }
+
+    if ((header_size + view->data_size + SUPLA_TAG_SIZE) > spd->in.data_size)
+      return SUPLA_RESULT_FALSE;
 
-  if (spd->in.begin_tag == 0 && spd->in.data_size >= SUPLA_TAG_SIZE) {
-    if (memcmp(spd->in.buffer, sproto_tag, SUPLA_TAG_SIZE) == 0) {
-      spd->in.begin_tag = 1;
-    } else {
-      sproto_shrink_in_buffer(&spd->in, spd->in.data_size);
+    sproto_buffer_read(&spd->in, header_size + view->data_size, tag,
+                       SUPLA_TAG_SIZE);
+
+    if (!sproto_is_tag(tag)) {
+      if (sproto_drop_broken_packet(spd)) continue;
       return SUPLA_RESULT_DATA_ERROR;
     }
+
+    spd->resync_pending = 0;
+
+    return (SUPLA_RESULT_TRUE);
   }
+}
+
+char sproto_pop_in_sdp(void *spd_ptr, TSuplaDataPacket *sdp) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t header_size =
+      sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE;
+  TSuplaDataPacketView view;
+  char result;
 
-  if (spd->in.begin_tag == 1) {
-    header_size = sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE;
-    if ((spd->in.data_size - SUPLA_TAG_SIZE) >= header_size) {
-      _sdp = (TSuplaDataPacket *)spd->in.buffer;
+  sproto_in_release_view(spd);
 
-      if (_sdp->version > SUPLA_PROTO_VERSION ||
-          _sdp->version < SUPLA_PROTO_VERSION_MIN) {
-        sdp->version = _sdp->version;
-        sproto_shrink_in_buffer(&spd->in, spd->in.data_size);
+  if (SUPLA_RESULT_TRUE != (result = sproto_in_next_packet(spd, &view))) {
+    if (result == (char)SUPLA_RESULT_VERSION_ERROR) sdp->version = view.version;
+    return result;
+  }
 
-        return SUPLA_RESULT_VERSION_ERROR;
-      }
+  sproto_buffer_read(&spd->in, 0, (char *)sdp, header_size + view.data_size);
+  sproto_shrink_in_buffer(spd, header_size + view.data_size + SUPLA_TAG_SIZE);
 
-      if ((header_size + _sdp->data_size + SUPLA_TAG_SIZE) >
-          sizeof(TSuplaDataPacket)) {
-        sproto_shrink_in_buffer(&spd->in, spd->in.data_size);
-        return SUPLA_RESULT_DATA_ERROR;
-      }
+  return (SUPLA_RESULT_TRUE);
+}
 
-      if ((header_size + _sdp->data_size + SUPLA_TAG_SIZE) > spd->in.data_size)
-        return SUPLA_RESULT_FALSE;
+char sproto_pop_in_view(void *spd_ptr, TSuplaDataPacketView *view) {
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+  unsigned _supla_int_t header_size =
+      sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE;
+  unsigned _supla_int_t n;
+  char *span;
+  char result;
 
-      if (header_size + _sdp->data_size >= spd->in.size ||
-          memcmp(&spd->in.buffer[header_size + _sdp->data_size], sproto_tag,
-                 SUPLA_TAG_SIZE) != 0) {
-        sproto_shrink_in_buffer(&spd->in, spd->in.data_size);
+  sproto_in_release_view(spd);
 
-        return SUPLA_RESULT_DATA_ERROR;
-      }
+  if (SUPLA_RESULT_TRUE != (result = sproto_in_next_packet(spd, view))) {
+    return result;
+  }
 
-      memcpy(sdp, spd->in.buffer, header_size + _sdp->data_size);
-      sproto_shrink_in_buffer(&spd->in,
-                              header_size + _sdp->data_size + SUPLA_TAG_SIZE);
+  n = sproto_buffer_span(&spd->in, header_size, view->data_size, &span);
 
-      return (SUPLA_RESULT_TRUE);
-    }
+  if (n < view->data_size) {
+    // Wrapped payload. Append the beginning of the ring to the tail.
+    memcpy(&span[n], spd->in.buffer, view->data_size - n);
   }
 
-  return (SUPLA_RESULT_FALSE);
+  view->data = span;
+  spd->view_size = header_size + view->data_size + SUPLA_TAG_SIZE;
+
+  return (SUPLA_RESULT_TRUE);
+}
+
+void sproto_set_resync(void *spd_ptr, unsigned char resync) {
+  ((TSuplaProtoData *)spd_ptr)->resync = resync ? 1 : 0;
 }
 
 void sproto_set_version(void *spd_ptr, unsigned char version) {
@@ -321,7 +677,8 @@ unsigned char sproto_get_version(void *spd_ptr) {
 void sproto_sdp_init(void *spd_ptr, TSuplaDataPacket *sdp) {
   TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
 
-  memset(sdp, 0, sizeof(TSuplaDataPacket));
+  // Only the header. The payload is never read past data_size.
+  memset(sdp, 0, sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE);
   memcpy(sdp->tag, sproto_tag, SUPLA_TAG_SIZE);
 
   spd->next_rr_id++;
@@ -354,6 +711,18 @@ char sproto_set_data(TSuplaDataPacket *sdp, char *data,
   return SUPLA_RESULT_TRUE;
 }
 
+#ifdef SPROTO_STATS
+static void sproto_log_buffer_stats(const char *name,
+                                    TSuplaProtoBufferStats *stats) {
+  supla_log(LOG_DEBUG, "BUFFER %s STATS", name);
+  supla_log(LOG_DEBUG, "    max_data_size: %u", stats->max_data_size);
+  supla_log(LOG_DEBUG, "         max_size: %u", stats->max_size);
+  supla_log(LOG_DEBUG, "       grow_count: %u", stats->grow_count);
+  supla_log(LOG_DEBUG, "     shrink_count: %u", stats->shrink_count);
+  supla_log(LOG_DEBUG, "   overflow_count: %u", stats->overflow_count);
+}
+#endif /*SPROTO_STATS*/
+
 void sproto_log_summary(void *spd_ptr) {
   if (spd_ptr == NULL) {
     supla_log(LOG_DEBUG, "SPROTO - Not initialized!");
@@ -366,27 +735,47 @@ void sproto_log_summary(void *spd_ptr) {
   supla_log(LOG_DEBUG, "         size: %i", spd->in.size);
   supla_log(LOG_DEBUG, "    data_size: %i", spd->in.data_size);
   supla_log(LOG_DEBUG, "    begin_tag: %i", spd->in.begin_tag);
+  if (spd->ring) supla_log(LOG_DEBUG, "         head: %i", spd->in.head);
 
   supla_log(LOG_DEBUG, "BUFFER OUT");
   supla_log(LOG_DEBUG, "         size: %i", spd->out.size);
   supla_log(LOG_DEBUG, "    data_size: %i", spd->out.data_size);
+  if (spd->ring) supla_log(LOG_DEBUG, "         head: %i", spd->out.head);
+
+#ifdef SPROTO_STATS
+  sproto_log_buffer_stats("IN", &spd->in.stats);
+  sproto_log_buffer_stats("OUT", &spd->out.stats);
+
+  supla_log(LOG_DEBUG, "RESYNC");
+  supla_log(LOG_DEBUG, "        count: %u", spd->resync_count);
+  supla_log(LOG_DEBUG, "    discarded: %u", spd->resync_discarded);
+#endif /*SPROTO_STATS*/
+}
+
+void sproto_get_stats(void *spd_ptr, TSuplaProtoStats *stats) {
+  memset(stats, 0, sizeof(TSuplaProtoStats));
+
+#ifdef SPROTO_STATS
+  TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
+
+  memcpy(&stats->in, &spd->in.stats, sizeof(TSuplaProtoBufferStats));
+  memcpy(&stats->out, &spd->out.stats, sizeof(TSuplaProtoBufferStats));
+  stats->resync_count = spd->resync_count;
+  stats->resync_discarded = spd->resync_discarded;
+#endif /*SPROTO_STATS*/
 }
 
 void sproto_buffer_dump(void *spd_ptr, unsigned char in) {
-  _supla_int_t a;
-  char *buffer;
-  _supla_int_t size;
+  unsigned _supla_int_t a;
+  char c;
+  TSuplaProtoBuffer *b;
 
   TSuplaProtoData *spd = (TSuplaProtoData *)spd_ptr;
 
-  if (in != 0) {
-    buffer = spd->in.buffer;
-    size = spd->in.data_size;
-  } else {
-    buffer = spd->out.buffer;
-    size = spd->out.data_size;
-  }
+  b = in != 0 ? &spd->in : &spd->out;
 
-  for (a = 0; a < size; a++)
-    supla_log(LOG_DEBUG, "%c [%i]", buffer[a], buffer[a]);
+  for (a = 0; a < b->data_size; a++) {
+    c = b->buffer[sproto_buffer_idx(b, a)];
+    supla_log(LOG_DEBUG, "%c [%i]", c, c);
+  }
 }
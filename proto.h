@@ -715,18 +715,95 @@ typedef struct {
 
 #pragma pack(pop)
 
+// Packet borrowed from the in buffer. data points into the buffer and stays
+// valid until the next append, pop or sproto_in_release_view call.
+typedef struct {
+  unsigned char version;
+  unsigned _supla_int_t rr_id;
+  unsigned _supla_int_t call_type;
+  unsigned _supla_int_t data_size;
+  const char *data;
+} TSuplaDataPacketView;
+
+// Buffer telemetry kept since sproto_init, to size BUFFER_MAX_SIZE and
+// SRPC_BUFFER_SIZE from field data. Left out of the microcontroller builds,
+// like SRPC_STATS; builds without it keep none of it and report zeros.
+#if !defined(ESP8266) && !defined(__AVR__) && !defined(SPROTO_WITHOUT_STATS)
+#define SPROTO_STATS
+#endif
+
+typedef struct {
+  unsigned _supla_int_t max_data_size;  // most bytes held at once
+  unsigned _supla_int_t max_size;       // largest allocation
+  // Reallocations of a dynamic buffer
+  unsigned _supla_int_t grow_count;
+  unsigned _supla_int_t shrink_count;
+  // SUPLA_RESULT_BUFFER_OVERFLOW results. On the out side they include
+  // packets that srpc kept in its queue until the buffer drained.
+  unsigned _supla_int_t overflow_count;
+} TSuplaProtoBufferStats;
+
+typedef struct {
+  TSuplaProtoBufferStats in;
+  TSuplaProtoBufferStats out;
+  unsigned _supla_int_t resync_count;
+  unsigned _supla_int_t resync_discarded;  // bytes skipped to find a tag
+} TSuplaProtoStats;
+
 void *sproto_init(void);
+// Fixed capacity ring buffers allocated once. Each of them has to be able to
+// hold at least one complete packet including the trailing tag, smaller
+// sizes are refused.
+#define SPROTO_RING_MIN_SIZE (sizeof(TSuplaDataPacket) + SUPLA_TAG_SIZE)
+void *sproto_init_ring(unsigned _supla_int_t in_size,
+                       unsigned _supla_int_t out_size);
 void sproto_free(void *spd_ptr);
 
 char sproto_in_buffer_append(void *spd_ptr, char *data,
                              unsigned _supla_int_t data_size);
 char sproto_out_buffer_append(void *spd_ptr, TSuplaDataPacket *sdp);
+// Contiguous room at the end of the out buffer for a packet with data_size
+// bytes of payload, or NULL. The packet is filled in place, header included,
+// and appended by sproto_out_buffer_commit. Nothing else may touch the out
+// buffer in between.
+TSuplaDataPacket *sproto_out_buffer_reserve(void *spd_ptr,
+                                            unsigned _supla_int_t data_size);
+void sproto_out_buffer_commit(void *spd_ptr, TSuplaDataPacket *sdp);
 
 char sproto_pop_in_sdp(void *spd_ptr, TSuplaDataPacket *sdp);
+// Same as sproto_pop_in_sdp but without copying the payload
+char sproto_pop_in_view(void *spd_ptr, TSuplaDataPacketView *view);
+void sproto_in_release_view(void *spd_ptr);
+// When enabled, a broken packet is skipped by scanning forward to the next
+// tag instead of discarding the whole in buffer with SUPLA_RESULT_DATA_ERROR
+void sproto_set_resync(void *spd_ptr, unsigned char resync);
 unsigned _supla_int_t sproto_pop_out_data(void *spd_ptr, char *buffer,
                                           unsigned _supla_int_t buffer_size);
+// Copies the front of the out buffer without removing it. The bytes leave
+// the buffer through sproto_out_consume, once the transport has taken them.
+unsigned _supla_int_t sproto_out_data_peek(void *spd_ptr, char *buffer,
+                                           unsigned _supla_int_t buffer_size);
+void sproto_out_consume(void *spd_ptr, unsigned _supla_int_t size);
+// Contiguous part of the out buffer starting at its front
+unsigned _supla_int_t sproto_out_data_span(void *spd_ptr, char **span);
+// Up to max_size bytes from the front of the out buffer as one or two
+// contiguous parts, the second one wrapped around to the start of the ring.
+// Returns the number of parts.
+unsigned char sproto_out_data_spans(void *spd_ptr,
+                                    unsigned _supla_int_t max_size,
+                                    char *span[2],
+                                    unsigned _supla_int_t span_size[2]);
+// Contiguous free space of the in ring. Data read into it is added to the
+// buffer by sproto_in_buffer_commit. Always 0 in the dynamic mode.
+unsigned _supla_int_t sproto_in_free_span(void *spd_ptr, char **span);
+char sproto_in_buffer_commit(void *spd_ptr, unsigned _supla_int_t size);
 char sproto_out_dataexists(void *spd_ptr);
+unsigned _supla_int_t sproto_out_data_size(void *spd_ptr);
 char sproto_in_dataexists(void *spd_ptr);
+// Tells whether the next sproto_pop_in_* has something to do: a complete
+// packet, judged by its header, or broken data to drop. A packet still being
+// received doesn't count.
+char sproto_in_packetexists(void *spd_ptr);
 
 unsigned char sproto_get_version(void *spd_ptr);
 void sproto_set_version(void *spd_ptr, unsigned char version);
@@ -738,6 +815,7 @@ TSuplaDataPacket *sproto_sdp_malloc(void *spd_ptr);
 void sproto_sdp_free(TSuplaDataPacket *sdp);
 
 void sproto_log_summary(void *spd_ptr);
+void sproto_get_stats(void *spd_ptr, TSuplaProtoStats *stats);
 void sproto_buffer_dump(void *spd_ptr, unsigned char in);
 
 #ifdef __cplusplus
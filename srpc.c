@@ -38,15 +38,19 @@
 
 #define SRPC_BUFFER_SIZE 1024
 #define SRPC_QUEUE_SIZE 8
-#define SRPC_QUEUE_MIN_ALLOC_COUNT 8
 
 #elif defined(__AVR__)
 
+#include <avr/pgmspace.h>
+
 #define SRPC_BUFFER_SIZE 1024
 #define SRPC_QUEUE_SIZE 8
-#define SRPC_QUEUE_MIN_ALLOC_COUNT 8
 #define __EH_DISABLED
 
+// Keep the call type table out of RAM
+#define SRPC_TABLE_ATTR PROGMEM
+#define srpc_table_read(dst, src, size) memcpy_P(dst, src, size)
+
 #else
 #include <assert.h>
 #endif
@@ -59,66 +63,269 @@
 #define SRPC_QUEUE_SIZE 10
 #endif /*SRPC_QUEUE_SIZE*/
 
-#ifndef SRPC_QUEUE_MIN_ALLOC_COUNT
-#define SRPC_QUEUE_MIN_ALLOC_COUNT 0
-#endif /*SRPC_QUEUE_MIN_ALLOC_COUNT*/
+#ifndef SRPC_TABLE_ATTR
+#define SRPC_TABLE_ATTR
+#define srpc_table_read(dst, src, size) memcpy(dst, src, size)
+#endif /*SRPC_TABLE_ATTR*/
 
-typedef struct {
-  unsigned char item_count;
-  unsigned char alloc_count;
+#ifdef SRPC_STATS
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif /*_WIN32*/
+
+// Frames in the out buffer waiting to be written, to measure their latency
+#define SRPC_STATS_MARK_COUNT 32
+#endif /*SRPC_STATS*/
 
-  TSuplaDataPacket *item[SRPC_QUEUE_SIZE];
+typedef struct {
+  // Header and data_size bytes of the payload. The buffer is kept for reuse
+  // after the packet is popped and grows only when a larger packet comes in.
+  TSuplaDataPacket *sdp;
+  unsigned _supla_int_t alloc_size;
+  unsigned _supla_int_t seq;  // commit order
+  // Slot numbers + 1 of the neighbours in the lane, 0 - none. A free slot
+  // links the next free one with next.
+  unsigned _supla_int_t prev;
+  unsigned _supla_int_t next;
+  unsigned char lane;
+#ifdef SRPC_STATS
+  unsigned long long commit_time_us;
+#endif /*SRPC_STATS*/
+} Tsrpc_QueueSlot;
+
+// Slots linked into one FIFO list per SRPC_LANE_* lane, with an open
+// addressing rr_id index. The oldest packet of the most urgent lane leaves
+// first. Slots never move, a popped one goes to the free list.
+typedef struct {
+  unsigned _supla_int_t size;
+  unsigned _supla_int_t item_count;
+  unsigned _supla_int_t seq;        // of the next committed packet
+  unsigned _supla_int_t free_head;  // slot number + 1, 0 - queue full
+  unsigned _supla_int_t lane_head[SRPC_LANE_COUNT];  // the same, 0 - empty
+  unsigned _supla_int_t lane_tail[SRPC_LANE_COUNT];
+  unsigned _supla_int_t data_size;  // bytes of the queued packets
+
+  Tsrpc_QueueSlot *slot;
+
+  unsigned _supla_int_t index_mask;
+  unsigned _supla_int_t *index;  // slot number + 1, 0 - empty
 } Tsrpc_Queue;
 
+#ifdef SRPC_STATS
+typedef struct {
+  unsigned _supla_int_t end;  // out stream offset right past the frame
+  unsigned _supla_int_t stats_idx;
+  unsigned long long commit_time_us;
+} Tsrpc_StatsMark;
+#endif /*SRPC_STATS*/
+
 typedef struct {
   void *proto;
   TsrpcParams params;
 
-  TSuplaDataPacket sdp;
+  TSuplaDataPacket in_sdp;  // scratch packet of the in path
+
+  // Packet being dispatched to on_remote_call_received straight from the in
+  // buffer. It is queued only if the callback doesn't take it.
+  TSuplaDataPacketView in_view;
+  unsigned char in_view_available;
+  unsigned char in_backlog;  // the last batch left complete packets behind
 
   Tsrpc_Queue in_queue;
   Tsrpc_Queue out_queue;
 
-  void *lck;
+  // Packet between srpc_out_reserve and srpc_out_commit. It is written
+  // straight into the out buffer when nothing is queued ahead of it, into an
+  // out queue slot otherwise.
+  TSuplaDataPacket *out_sdp;
+  unsigned char out_sdp_queued;
+  unsigned char out_lane;
+  unsigned char out_blocked;  // a call failed for lack of room
+  unsigned _supla_int_t out_call_type;
+  unsigned _supla_int_t out_data_size;
+
+  // Scratch space for data_read and data_write, NULL in the ring mode
+  char *io_buffer;
+  unsigned _supla_int_t io_buffer_size;
+
+  // The in path (in buffer, in_view, in_queue) and the out path (out buffer,
+  // out_queue, out_sdp) have separate locks, so one thread can send while
+  // another one receives. Both are taken, in_lck first, only to change the
+  // protocol version.
+  void *in_lck;
+  void *out_lck;
+
+#ifdef SRPC_STATS
+  // One entry per call type table entry and the last one for the rest. The
+  // in counters are guarded by in_lck, the out ones by out_lck.
+  TsrpcCallStats *stats;
+
+  // Frames appended to the out buffer and not written yet, oldest first.
+  // Offsets count the bytes of the out stream and may wrap around.
+  Tsrpc_StatsMark mark[SRPC_STATS_MARK_COUNT];
+  unsigned char mark_head;
+  unsigned char mark_count;
+  unsigned _supla_int_t out_appended;
+  unsigned _supla_int_t out_written;
+#endif /*SRPC_STATS*/
 } Tsrpc;
 
+#if !defined(ESP8266) && !defined(__AVR__)
+static char srpc_call_types_sorted(void);
+#endif
+
+#ifdef SRPC_STATS
+static char srpc_stats_init(Tsrpc *srpc);
+static void srpc_stats_in(Tsrpc *srpc, TSuplaDataPacketView *view);
+static void srpc_stats_error(Tsrpc *srpc, unsigned _supla_int_t call_type,
+                             char result);
+static void srpc_stats_commit(Tsrpc *srpc, TSuplaDataPacket *sdp);
+static void srpc_stats_dequeue(Tsrpc *srpc);
+static void srpc_stats_written(Tsrpc *srpc, unsigned _supla_int_t size);
+static void srpc_stats_refused(Tsrpc *srpc, unsigned _supla_int_t call_type,
+                               unsigned char dropped);
+#else
+#define srpc_stats_in(srpc, view)
+#define srpc_stats_error(srpc, call_type, result)
+#define srpc_stats_commit(srpc, sdp)
+#define srpc_stats_dequeue(srpc)
+#define srpc_stats_written(srpc, size)
+#define srpc_stats_refused(srpc, call_type, dropped)
+#endif /*SRPC_STATS*/
+
 void SRPC_ICACHE_FLASH srpc_params_init(TsrpcParams *params) {
   memset(params, 0, sizeof(TsrpcParams));
 }
 
+void *SRPC_ICACHE_FLASH srpc_get_user_params(void *_srpc) {
+  return ((Tsrpc *)_srpc)->params.user_params;
+}
+
+char SRPC_ICACHE_FLASH srpc_queue_init(Tsrpc_Queue *queue,
+                                       unsigned _supla_int_t size) {
+  unsigned _supla_int_t index_size = 2;
+  unsigned _supla_int_t a;
+
+  if (size == 0) size = SRPC_QUEUE_SIZE;
+
+  // At least twice the capacity keeps the probe sequences short
+  while (index_size < size * 2) {
+    index_size <<= 1;
+  }
+
+  queue->slot = (Tsrpc_QueueSlot *)malloc(sizeof(Tsrpc_QueueSlot) * size);
+  queue->index = (unsigned _supla_int_t *)malloc(
+      sizeof(unsigned _supla_int_t) * index_size);
+
+  if (queue->slot == NULL || queue->index == NULL) {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  memset(queue->slot, 0, sizeof(Tsrpc_QueueSlot) * size);
+  memset(queue->index, 0, sizeof(unsigned _supla_int_t) * index_size);
+
+  for (a = 0; a < size - 1; a++) {
+    queue->slot[a].next = a + 2;
+  }
+
+  queue->size = size;
+  queue->index_mask = index_size - 1;
+  queue->item_count = 0;
+  queue->seq = 0;
+  queue->free_head = 1;
+  memset(queue->lane_head, 0, sizeof(queue->lane_head));
+  memset(queue->lane_tail, 0, sizeof(queue->lane_tail));
+  queue->data_size = 0;
+
+  return SUPLA_RESULT_TRUE;
+}
+
 void *SRPC_ICACHE_FLASH srpc_init(TsrpcParams *params) {
   Tsrpc *srpc = (Tsrpc *)malloc(sizeof(Tsrpc));
 
   if (srpc == NULL) return NULL;
 
   memset(srpc, 0, sizeof(Tsrpc));
-  srpc->proto = sproto_init();
+
+  if (params != NULL && params->ring_buffer_size > 0) {
+    srpc->proto =
+        sproto_init_ring(params->ring_buffer_size, params->ring_buffer_size);
+  } else {
+    srpc->proto = sproto_init();
+  }
 
 #ifndef ESP8266
 #ifndef __AVR__
   assert(params != 0);
   assert(params->data_read != 0);
-  assert(params->data_write != 0);
+  assert(params->data_write != 0 || params->data_writev != 0);
+  assert(srpc_call_types_sorted());
 #endif
 #endif
 
   memcpy(&srpc->params, params, sizeof(TsrpcParams));
 
-  srpc->lck = lck_init();
+  if (srpc->proto != NULL) {
+    sproto_set_resync(srpc->proto, params->resync);
+  }
+
+  srpc->in_lck = lck_init_policy(params->lock_policy);
+  srpc->out_lck = lck_init_policy(params->lock_policy);
+
+  srpc->io_buffer_size =
+      params->io_buffer_size > 0 ? params->io_buffer_size : SRPC_BUFFER_SIZE;
+
+  // Ring buffers are read into and written from in place
+  if (params->ring_buffer_size == 0) {
+    srpc->io_buffer = (char *)malloc(srpc->io_buffer_size);
+  }
+
+  if (srpc->proto == NULL ||
+      (srpc->io_buffer == NULL && params->ring_buffer_size == 0) ||
+      SUPLA_RESULT_TRUE !=
+          srpc_queue_init(&srpc->in_queue, params->queue_size) ||
+      SUPLA_RESULT_TRUE !=
+          srpc_queue_init(&srpc->out_queue, params->queue_size)) {
+    srpc_free(srpc);
+    return NULL;
+  }
+
+#ifdef SRPC_STATS
+  if (SUPLA_RESULT_TRUE != srpc_stats_init(srpc)) {
+    srpc_free(srpc);
+    return NULL;
+  }
+#endif /*SRPC_STATS*/
 
   return srpc;
 }
 
 void SRPC_ICACHE_FLASH srpc_queue_free(Tsrpc_Queue *queue) {
-  _supla_int_t a;
-  for (a = 0; a < SRPC_QUEUE_SIZE; a++) {
-    if (queue->item[a] != NULL) {
-      free(queue->item[a]);
+  unsigned _supla_int_t a;
+
+  if (queue->slot != NULL) {
+    for (a = 0; a < queue->size; a++) {
+      if (queue->slot[a].sdp != NULL) {
+        free(queue->slot[a].sdp);
+      }
     }
+
+    free(queue->slot);
+    queue->slot = NULL;
+  }
+
+  if (queue->index != NULL) {
+    free(queue->index);
+    queue->index = NULL;
   }
 
+  queue->size = 0;
   queue->item_count = 0;
-  queue->alloc_count = 0;
+  queue->free_head = 0;
+  memset(queue->lane_head, 0, sizeof(queue->lane_head));
+  memset(queue->lane_tail, 0, sizeof(queue->lane_tail));
 }
 
 void SRPC_ICACHE_FLASH srpc_free(void *_srpc) {
@@ -129,68 +336,307 @@ void SRPC_ICACHE_FLASH srpc_free(void *_srpc) {
     srpc_queue_free(&srpc->in_queue);
     srpc_queue_free(&srpc->out_queue);
 
-    lck_free(srpc->lck);
+    if (srpc->io_buffer != NULL) {
+      free(srpc->io_buffer);
+    }
+
+    lck_free(srpc->in_lck);
+    lck_free(srpc->out_lck);
+
+#ifdef SRPC_STATS
+    if (srpc->stats != NULL) {
+      free(srpc->stats);
+    }
+#endif /*SRPC_STATS*/
 
     free(srpc);
   }
 }
 
+static unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_sdp_size(TSuplaDataPacket *sdp) {
+  return sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE + sdp->data_size;
+}
+
+static unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_queue_hash(Tsrpc_Queue *queue, unsigned _supla_int_t rr_id) {
+  rr_id = (rr_id ^ (rr_id >> 16)) * 0x45d9f3b;
+  return (rr_id ^ (rr_id >> 16)) & queue->index_mask;
+}
+
+static void SRPC_ICACHE_FLASH srpc_queue_index_add(Tsrpc_Queue *queue,
+                                                   unsigned _supla_int_t slot) {
+  unsigned _supla_int_t pos =
+      srpc_queue_hash(queue, queue->slot[slot].sdp->rr_id);
+
+  while (queue->index[pos] != 0) {
+    pos = (pos + 1) & queue->index_mask;
+  }
+
+  queue->index[pos] = slot + 1;
+}
+
+// Backward shift deletion, so no tombstones are needed in the index
+static void SRPC_ICACHE_FLASH
+srpc_queue_index_remove(Tsrpc_Queue *queue, unsigned _supla_int_t pos) {
+  unsigned _supla_int_t next = pos;
+  unsigned _supla_int_t home;
+
+  while (1) {
+    next = (next + 1) & queue->index_mask;
+
+    if (queue->index[next] == 0) break;
+
+    home = srpc_queue_hash(queue,
+                           queue->slot[queue->index[next] - 1].sdp->rr_id);
+
+    // Move the entry back unless its home lies cyclically in (pos, next]
+    if (((next - home) & queue->index_mask) >=
+        ((next - pos) & queue->index_mask)) {
+      queue->index[pos] = queue->index[next];
+      pos = next;
+    }
+  }
+
+  queue->index[pos] = 0;
+}
+
+// Index position of the oldest packet with the given rr_id
+static char SRPC_ICACHE_FLASH srpc_queue_index_find(
+    Tsrpc_Queue *queue, unsigned _supla_int_t rr_id,
+    unsigned _supla_int_t *result) {
+  unsigned _supla_int_t pos = srpc_queue_hash(queue, rr_id);
+  unsigned _supla_int_t age, max_age = 0;
+  unsigned _supla_int_t slot;
+  char found = SUPLA_RESULT_FALSE;
+
+  while (queue->index[pos] != 0) {
+    slot = queue->index[pos] - 1;
+
+    if (queue->slot[slot].sdp->rr_id == rr_id) {
+      // Wraps along with seq, the queued packets are never that far apart
+      age = queue->seq - queue->slot[slot].seq;
+
+      if (found == SUPLA_RESULT_FALSE || age > max_age) {
+        max_age = age;
+        *result = pos;
+        found = SUPLA_RESULT_TRUE;
+      }
+    }
+
+    pos = (pos + 1) & queue->index_mask;
+  }
+
+  return found;
+}
+
+// Index position of the given slot
+static unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_queue_index_pos(Tsrpc_Queue *queue, unsigned _supla_int_t slot) {
+  unsigned _supla_int_t pos =
+      srpc_queue_hash(queue, queue->slot[slot].sdp->rr_id);
+
+  while (queue->index[pos] != slot + 1) {
+    pos = (pos + 1) & queue->index_mask;
+  }
+
+  return pos;
+}
+
+// Slot buffer for the next packet, at least size bytes long. The packet is
+// written in place and becomes part of the queue after srpc_queue_commit.
+static TSuplaDataPacket *SRPC_ICACHE_FLASH
+srpc_queue_reserve(Tsrpc_Queue *queue, unsigned _supla_int_t size) {
+  Tsrpc_QueueSlot *slot;
+
+  if (queue->free_head == 0 || size > sizeof(TSuplaDataPacket)) {
+    return NULL;
+  }
+
+  slot = &queue->slot[queue->free_head - 1];
+
+  if (slot->sdp == NULL || slot->alloc_size < size) {
+    TSuplaDataPacket *item = (TSuplaDataPacket *)realloc(slot->sdp, size);
+
+    if (item == NULL) {
+      return NULL;
+    }
+
+    slot->sdp = item;
+    slot->alloc_size = size;
+  }
+
+  return slot->sdp;
+}
+
+// Appends the reserved slot to the tail of the lane
+static void SRPC_ICACHE_FLASH srpc_queue_commit(Tsrpc_Queue *queue,
+                                                unsigned char lane) {
+  unsigned _supla_int_t idx = queue->free_head - 1;
+  Tsrpc_QueueSlot *slot = &queue->slot[idx];
+
+  queue->free_head = slot->next;
+
+  slot->lane = lane;
+  slot->seq = queue->seq++;
+  slot->prev = queue->lane_tail[lane];
+  slot->next = 0;
+
+  if (queue->lane_tail[lane] != 0) {
+    queue->slot[queue->lane_tail[lane] - 1].next = idx + 1;
+  } else {
+    queue->lane_head[lane] = idx + 1;
+  }
+
+  queue->lane_tail[lane] = idx + 1;
+  queue->data_size += srpc_sdp_size(slot->sdp);
+  queue->item_count++;
+  srpc_queue_index_add(queue, idx);
+}
+
 char SRPC_ICACHE_FLASH srpc_queue_push(Tsrpc_Queue *queue,
                                        TSuplaDataPacket *sdp) {
-  if (queue->item_count >= SRPC_QUEUE_SIZE) {
+  unsigned _supla_int_t size;
+  TSuplaDataPacket *item;
+
+  if (sdp->data_size > SUPLA_MAX_DATA_SIZE) {
     return SUPLA_RESULT_FALSE;
   }
 
-  if (queue->item[queue->item_count] == NULL) {
-    queue->item[queue->item_count] =
-        (TSuplaDataPacket *)malloc(sizeof(TSuplaDataPacket));
-  }
+  size = srpc_sdp_size(sdp);
+  item = srpc_queue_reserve(queue, size);
 
-  if (queue->item[queue->item_count] == NULL) {
+  if (item == NULL) {
     return SUPLA_RESULT_FALSE;
-  } else {
-    queue->alloc_count++;
   }
 
-  memcpy(queue->item[queue->item_count], sdp, sizeof(TSuplaDataPacket));
-  queue->item_count++;
+  memcpy(item, sdp, size);
+  srpc_queue_commit(queue, SRPC_LANE_CONTROL);
 
   return SUPLA_RESULT_TRUE;
 }
 
-char SRPC_ICACHE_FLASH srpc_queue_pop(Tsrpc_Queue *queue, TSuplaDataPacket *sdp,
-                                      unsigned _supla_int_t rr_id) {
-  _supla_int_t a, b;
+static char SRPC_ICACHE_FLASH srpc_queue_lane_first(
+    Tsrpc_Queue *queue, unsigned char lane, unsigned _supla_int_t *result) {
+  if (queue->lane_head[lane] == 0) {
+    return SUPLA_RESULT_FALSE;
+  }
 
-  for (a = 0; a < queue->item_count; a++)
-    if (rr_id == 0 || queue->item[a]->rr_id == rr_id) {
-      memcpy(sdp, queue->item[a], sizeof(TSuplaDataPacket));
+  *result = queue->lane_head[lane] - 1;
+  return SUPLA_RESULT_TRUE;
+}
 
-      if (queue->alloc_count > SRPC_QUEUE_MIN_ALLOC_COUNT) {
-        queue->alloc_count--;
-        free(queue->item[a]);
-        queue->item[a] = NULL;
-      }
+// Slot of the oldest packet in the most urgent lane
+static char SRPC_ICACHE_FLASH srpc_queue_first(Tsrpc_Queue *queue,
+                                               unsigned _supla_int_t *result) {
+  unsigned char lane;
+
+  for (lane = 0; lane < SRPC_LANE_COUNT; lane++) {
+    if (srpc_queue_lane_first(queue, lane, result) == SUPLA_RESULT_TRUE) {
+      return SUPLA_RESULT_TRUE;
+    }
+  }
 
-      TSuplaDataPacket *item = queue->item[a];
+  return SUPLA_RESULT_FALSE;
+}
 
-      for (b = a; b < queue->item_count - 1; b++) {
-        queue->item[b] = queue->item[b + 1];
-      }
+// Unlinks the slot from its lane and hands it to the free list
+static void SRPC_ICACHE_FLASH srpc_queue_remove(Tsrpc_Queue *queue,
+                                                unsigned _supla_int_t idx,
+                                                unsigned _supla_int_t pos) {
+  Tsrpc_QueueSlot *slot = &queue->slot[idx];
 
-      queue->item_count--;
-      queue->item[queue->item_count] = item;
+  srpc_queue_index_remove(queue, pos);
 
+  if (slot->prev != 0) {
+    queue->slot[slot->prev - 1].next = slot->next;
+  } else {
+    queue->lane_head[slot->lane] = slot->next;
+  }
+
+  if (slot->next != 0) {
+    queue->slot[slot->next - 1].prev = slot->prev;
+  } else {
+    queue->lane_tail[slot->lane] = slot->prev;
+  }
+
+  queue->data_size -= srpc_sdp_size(slot->sdp);
+  queue->item_count--;
+
+  slot->next = queue->free_head;
+  queue->free_head = idx + 1;
+}
+
+// Slot of the oldest packet of the least urgent lane behind the given one,
+// the one to drop when a packet of that lane finds the queue full
+static char SRPC_ICACHE_FLASH srpc_queue_victim(Tsrpc_Queue *queue,
+                                                unsigned char lane,
+                                                unsigned _supla_int_t *result) {
+  unsigned char a;
+
+  for (a = SRPC_LANE_COUNT - 1; a > lane; a--) {
+    if (srpc_queue_lane_first(queue, a, result) == SUPLA_RESULT_TRUE) {
       return SUPLA_RESULT_TRUE;
     }
+  }
 
   return SUPLA_RESULT_FALSE;
 }
 
+// Next packet to leave the queue, left in place
+TSuplaDataPacket *SRPC_ICACHE_FLASH srpc_queue_peek(Tsrpc_Queue *queue) {
+  unsigned _supla_int_t idx;
+
+  return srpc_queue_first(queue, &idx) == SUPLA_RESULT_TRUE
+             ? queue->slot[idx].sdp
+             : NULL;
+}
+
+char SRPC_ICACHE_FLASH srpc_queue_pop(Tsrpc_Queue *queue, TSuplaDataPacket *sdp,
+                                      unsigned _supla_int_t rr_id) {
+  unsigned _supla_int_t pos = 0, idx;
+
+  if (queue->item_count == 0) {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  if (rr_id == 0) {
+    if (srpc_queue_first(queue, &idx) != SUPLA_RESULT_TRUE) {
+      return SUPLA_RESULT_FALSE;
+    }
+
+    pos = srpc_queue_index_pos(queue, idx);
+  } else if (srpc_queue_index_find(queue, rr_id, &pos) == SUPLA_RESULT_TRUE) {
+    idx = queue->index[pos] - 1;
+  } else {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  if (sdp != NULL) {
+    memcpy(sdp, queue->slot[idx].sdp, srpc_sdp_size(queue->slot[idx].sdp));
+  }
+
+  srpc_queue_remove(queue, idx, pos);
+  return SUPLA_RESULT_TRUE;
+}
+
 char SRPC_ICACHE_FLASH srpc_in_queue_push(Tsrpc *srpc, TSuplaDataPacket *sdp) {
   return srpc_queue_push(&srpc->in_queue, sdp);
 }
 
+char SRPC_ICACHE_FLASH srpc_in_queue_push_view(Tsrpc *srpc) {
+  srpc->in_sdp.version = srpc->in_view.version;
+  srpc->in_sdp.rr_id = srpc->in_view.rr_id;
+  srpc->in_sdp.call_type = srpc->in_view.call_type;
+  srpc->in_sdp.data_size = srpc->in_view.data_size;
+
+  if (srpc->in_view.data_size > 0) {
+    memcpy(srpc->in_sdp.data, srpc->in_view.data, srpc->in_view.data_size);
+  }
+
+  return srpc_in_queue_push(srpc, &srpc->in_sdp);
+}
+
 char SRPC_ICACHE_FLASH srpc_in_queue_pop(Tsrpc *srpc, TSuplaDataPacket *sdp,
                                          unsigned _supla_int_t rr_id) {
   return srpc_queue_pop(&srpc->in_queue, sdp, rr_id);
@@ -208,90 +654,252 @@ char SRPC_ICACHE_FLASH srpc_out_queue_pop(Tsrpc *srpc, TSuplaDataPacket *sdp,
 char SRPC_ICACHE_FLASH srpc_input_dataexists(void *_srpc) {
   int result = SUPLA_RESULT_FALSE;
   Tsrpc *srpc = (Tsrpc *)_srpc;
-  lck_lock(srpc->lck);
+  lck_lock(srpc->in_lck);
   result = sproto_in_dataexists(srpc->proto);
-  return lck_unlock_r(srpc->lck, result);
+  return lck_unlock_r(srpc->in_lck, result);
+}
+
+static void SRPC_ICACHE_FLASH srpc_raise_event(Tsrpc *srpc) {
+#ifndef __EH_DISABLED
+  if (srpc->params.eh != 0) {
+    eh_raise_event(srpc->params.eh);
+  }
+#endif
+
+  if (srpc->params.on_work_pending != NULL) {
+    srpc->params.on_work_pending(srpc, srpc->params.user_params);
+  }
 }
 
 char SRPC_ICACHE_FLASH srpc_iterate(void *_srpc) {
+  return srpc_iterate_batch(_srpc, 1);
+}
+
+char SRPC_ICACHE_FLASH srpc_iterate_batch(void *_srpc,
+                                          unsigned _supla_int_t max_count) {
   Tsrpc *srpc = (Tsrpc *)_srpc;
-  char data_buffer[SRPC_BUFFER_SIZE];
+  char *data_buffer = srpc->io_buffer;
   char result;
   unsigned char version;
+  unsigned _supla_int_t rr_id;
+  unsigned _supla_int_t call_type;
+  unsigned _supla_int_t count;
+  unsigned char in_pending;
+  TSuplaDataPacket *sdp;
+  char *span;
+  char *out_span[2];
+  unsigned _supla_int_t out_span_size[2];
+  TsrpcIoVec iov[2];
+  unsigned char iov_count;
+  unsigned char out_stalled = 0;
+  _supla_int_t written;
+  _supla_int_t data_size = srpc->io_buffer_size;
 
   // --------- IN ---------------
-  _supla_int_t data_size = srpc->params.data_read(data_buffer, SRPC_BUFFER_SIZE,
-                                                  srpc->params.user_params);
+  if (srpc->params.ring_buffer_size > 0) {
+    // Read straight into the free part of the in ring
+    lck_lock(srpc->in_lck);
+    data_size = sproto_in_free_span(srpc->proto, &span);
+    lck_unlock(srpc->in_lck);
+
+    if (data_size > srpc->io_buffer_size) data_size = srpc->io_buffer_size;
+
+    data_buffer = span;
+  }
+
+  // Packets left over by the batch limit go first, otherwise a fast sender
+  // could grow the in buffer without bound
+  if (srpc->in_backlog) {
+    data_size = 0;
+  }
+
+  data_size = data_size > 0 ? srpc->params.data_read(data_buffer, data_size,
+                                                     srpc->params.user_params)
+                            : -1;
 
   if (data_size == 0) return SUPLA_RESULT_FALSE;
 
-  lck_lock(srpc->lck);
-
-  if (data_size > 0 &&
-      SUPLA_RESULT_TRUE != (result = sproto_in_buffer_append(
-                                srpc->proto, data_buffer, data_size))) {
-    supla_log(LOG_DEBUG, "sproto_in_buffer_append: %i, datasize: %i", result,
-              data_size);
-    return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
-  }
-
-  if (SUPLA_RESULT_TRUE ==
-      (result = sproto_pop_in_sdp(srpc->proto, &srpc->sdp))) {
-    if (SUPLA_RESULT_TRUE == srpc_in_queue_push(srpc, &srpc->sdp)) {
-      if (srpc->params.on_remote_call_received) {
-        lck_unlock(srpc->lck);
-        srpc->params.on_remote_call_received(
-            srpc, srpc->sdp.rr_id, srpc->sdp.call_type,
-            srpc->params.user_params, srpc->sdp.version);
-        lck_lock(srpc->lck);
+  lck_lock(srpc->in_lck);
+
+  if (data_size > 0) {
+    result = srpc->params.ring_buffer_size > 0
+                 ? sproto_in_buffer_commit(srpc->proto, data_size)
+                 : sproto_in_buffer_append(srpc->proto, data_buffer, data_size);
+
+    if (result != SUPLA_RESULT_TRUE) {
+      srpc_stats_error(srpc, 0, result);
+      supla_log(LOG_DEBUG, "sproto_in_buffer_append: %i, datasize: %i", result,
+                data_size);
+      return lck_unlock_r(srpc->in_lck, SUPLA_RESULT_FALSE);
+    }
+  }
+
+  for (count = 0; max_count == 0 || count < max_count; count++) {
+    result = sproto_pop_in_view(srpc->proto, &srpc->in_view);
+
+    if (result == SUPLA_RESULT_FALSE) {
+      break;
+    }
+
+    if (result != SUPLA_RESULT_TRUE) {
+      // The header can't be trusted, so neither can the call type
+      srpc_stats_error(srpc, 0, result);
+
+      if (result == (char)SUPLA_RESULT_VERSION_ERROR) {
+        if (srpc->params.on_version_error) {
+          version = srpc->in_view.version;
+          lck_unlock(srpc->in_lck);
+
+          srpc->params.on_version_error(srpc, version,
+                                        srpc->params.user_params);
+          return SUPLA_RESULT_FALSE;
+        }
+      } else {
+        supla_log(LOG_DEBUG, "sproto_pop_in_sdp error: %i", result);
       }
 
-    } else {
+      return lck_unlock_r(srpc->in_lck, SUPLA_RESULT_FALSE);
+    }
+
+    srpc_stats_in(srpc, &srpc->in_view);
+
+    // Borrowing is only safe when nothing older is waiting in the queue
+    srpc->in_view_available = srpc->in_queue.item_count == 0 &&
+                              srpc->params.on_remote_call_received != NULL;
+
+    if (!srpc->in_view_available &&
+        SUPLA_RESULT_TRUE != srpc_in_queue_push_view(srpc)) {
       supla_log(LOG_DEBUG, "ssrpc_in_queue_push error");
-      return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
+      return lck_unlock_r(srpc->in_lck, SUPLA_RESULT_FALSE);
     }
 
-  } else if (result != SUPLA_RESULT_FALSE) {
-    if (result == (char)SUPLA_RESULT_VERSION_ERROR) {
-      if (srpc->params.on_version_error) {
-        version = srpc->sdp.version;
-        lck_unlock(srpc->lck);
+    if (srpc->params.on_remote_call_received) {
+      rr_id = srpc->in_view.rr_id;
+      call_type = srpc->in_view.call_type;
+      version = srpc->in_view.version;
+
+      lck_unlock(srpc->in_lck);
+      srpc->params.on_remote_call_received(srpc, rr_id, call_type,
+                                           srpc->params.user_params, version);
+      lck_lock(srpc->in_lck);
+    }
 
-        srpc->params.on_version_error(srpc, version, srpc->params.user_params);
-        return SUPLA_RESULT_FALSE;
+    if (srpc->in_view_available) {
+      srpc->in_view_available = 0;
+
+      if (SUPLA_RESULT_TRUE != srpc_in_queue_push_view(srpc)) {
+        supla_log(LOG_DEBUG, "ssrpc_in_queue_push error");
+        return lck_unlock_r(srpc->in_lck, SUPLA_RESULT_FALSE);
       }
-    } else {
-      supla_log(LOG_DEBUG, "sproto_pop_in_sdp error: %i", result);
     }
 
-    return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
+    sproto_in_release_view(srpc->proto);
   }
 
+  // Budget used up and a complete packet waiting. The tail of one still
+  // being received needs another data_read first.
+  in_pending = max_count != 0 && count >= max_count &&
+               sproto_in_packetexists(srpc->proto) == SUPLA_RESULT_TRUE;
+  srpc->in_backlog = in_pending;
+
+  lck_unlock(srpc->in_lck);
+
   // --------- OUT ---------------
 
-  if (srpc_out_queue_pop(srpc, &srpc->sdp, 0) == SUPLA_RESULT_TRUE &&
-      SUPLA_RESULT_TRUE !=
-          (result = sproto_out_buffer_append(srpc->proto, &srpc->sdp)) &&
-      result != SUPLA_RESULT_FALSE) {
+  lck_lock(srpc->out_lck);
+
+  for (count = 0; max_count == 0 || count < max_count; count++) {
+    // The packet leaves the queue only once it is in the out buffer
+    if ((sdp = srpc_queue_peek(&srpc->out_queue)) == NULL) {
+      break;
+    }
+
+    result = sproto_out_buffer_append(srpc->proto, sdp);
+
+    if (result == SUPLA_RESULT_TRUE) {
+      srpc_stats_dequeue(srpc);
+      srpc_queue_pop(&srpc->out_queue, NULL, 0);
+      continue;
+    }
+
+    // No room at the moment. Retry once the buffer has been written out.
+    if ((result == SUPLA_RESULT_FALSE ||
+         result == (char)SUPLA_RESULT_BUFFER_OVERFLOW) &&
+        sproto_out_dataexists(srpc->proto) == SUPLA_RESULT_TRUE) {
+      break;
+    }
+
+    srpc_queue_pop(&srpc->out_queue, NULL, 0);
     supla_log(LOG_DEBUG, "sproto_out_buffer_append error: %i", result);
-    return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
+    return lck_unlock_r(srpc->out_lck, SUPLA_RESULT_FALSE);
   }
 
-  data_size = sproto_pop_out_data(srpc->proto, data_buffer, SRPC_BUFFER_SIZE);
+  // Bytes stay in the out buffer until data_write takes them. Whatever a
+  // short write leaves behind goes first in the next iteration.
+  if (srpc->params.ring_buffer_size > 0) {
+    // The front of the ring is only ever consumed here, so it can be
+    // written out in place while the lock is released
+    iov_count = sproto_out_data_spans(srpc->proto, srpc->io_buffer_size,
+                                      out_span, out_span_size);
+  } else {
+    out_span[0] = srpc->io_buffer;
+    out_span_size[0] = sproto_out_data_peek(
+        srpc->proto, srpc->io_buffer, srpc->io_buffer_size);
+    iov_count = out_span_size[0] > 0 ? 1 : 0;
+  }
+
+  // Without data_writev the wrapped around part waits for the next round
+  if (srpc->params.data_writev == NULL && iov_count > 1) {
+    iov_count = 1;
+  }
+
+  for (data_size = 0, count = 0; count < iov_count; count++) {
+    iov[count].data = out_span[count];
+    iov[count].size = out_span_size[count];
+    data_size += out_span_size[count];
+  }
 
   if (data_size != 0) {
-    lck_unlock(srpc->lck);
-    srpc->params.data_write(data_buffer, data_size, srpc->params.user_params);
-    lck_lock(srpc->lck);
+    lck_unlock(srpc->out_lck);
+    written = srpc->params.data_writev != NULL
+                  ? srpc->params.data_writev(iov, iov_count,
+                                             srpc->params.user_params)
+                  : srpc->params.data_write(iov[0].data, iov[0].size,
+                                            srpc->params.user_params);
+    lck_lock(srpc->out_lck);
+
+    if (written > 0) {
+      written = written < data_size ? written : data_size;
+      sproto_out_consume(srpc->proto, written);
+      srpc_stats_written(srpc, written);
+    }
 
-#ifndef __EH_DISABLED
-    if (srpc->params.eh != 0 && sproto_out_dataexists(srpc->proto) == 1) {
-      eh_raise_event(srpc->params.eh);
+    out_stalled = written < data_size;
+  }
+
+  // Let the caller retry what was refused while the queue was full
+  if (srpc->out_blocked &&
+      srpc->out_queue.item_count < srpc->out_queue.size) {
+    srpc->out_blocked = 0;
+
+    if (srpc->params.on_out_writable) {
+      lck_unlock(srpc->out_lck);
+      srpc->params.on_out_writable(srpc, srpc->params.user_params);
+      lck_lock(srpc->out_lck);
     }
-#endif
   }
 
-  return lck_unlock_r(srpc->lck, SUPLA_RESULT_TRUE);
+  // Come back soon if something was left for the next iteration. Output
+  // refused by a full transport waits for the caller's own wakeup instead,
+  // as retrying at once would only spin.
+  if ((!out_stalled &&
+       (sproto_out_dataexists(srpc->proto) == SUPLA_RESULT_TRUE ||
+        srpc->out_queue.item_count > 0)) ||
+      in_pending) {
+    srpc_raise_event(srpc);
+  }
+
+  return lck_unlock_r(srpc->out_lck, SUPLA_RESULT_TRUE);
 }
 
 typedef unsigned _supla_int_t (*_func_srpc_pack_get_caption_size)(
@@ -306,8 +914,9 @@ typedef unsigned _supla_int_t (*_func_srpc_pack_get_caption_size)(
     void *pack, _supla_int_t idx);
 
 void SRPC_ICACHE_FLASH srpc_getpack(
-    Tsrpc *srpc, TsrpcReceivedData *rd, unsigned _supla_int_t pack_sizeof,
-    unsigned _supla_int_t item_sizeof, unsigned _supla_int_t pack_max_count,
+    TSuplaDataPacketView *view, TsrpcReceivedData *rd,
+    unsigned _supla_int_t pack_sizeof, unsigned _supla_int_t item_sizeof,
+    unsigned _supla_int_t pack_max_count,
     unsigned _supla_int_t caption_max_size,
     _func_srpc_pack_get_pack_count pack_get_count,
     _func_srpc_pack_set_pack_count pack_set_count,
@@ -318,11 +927,11 @@ void SRPC_ICACHE_FLASH srpc_getpack(
   _supla_int_t a, count, size, offset, pack_size;
   void *pack = NULL;
 
-  if (srpc->sdp.data_size < header_size || srpc->sdp.data_size > pack_sizeof) {
+  if (view->data_size < header_size || view->data_size > pack_sizeof) {
     return;
   }
 
-  count = pack_get_count(srpc->sdp.data);
+  count = pack_get_count((void *)view->data);
 
   if (count < 0 || count > pack_max_count) {
     return;
@@ -334,18 +943,18 @@ void SRPC_ICACHE_FLASH srpc_getpack(
   if (pack == NULL) return;
 
   memset(pack, 0, pack_size);
-  memcpy(pack, srpc->sdp.data, header_size);
+  memcpy(pack, view->data, header_size);
 
   offset = header_size;
   pack_set_count(pack, 0, 0);
 
   for (a = 0; a < count; a++)
-    if (srpc->sdp.data_size - offset >= c_header_size) {
-      size = get_item_caption_size(&srpc->sdp.data[offset]);
+    if (view->data_size - offset >= c_header_size) {
+      size = get_item_caption_size((void *)&view->data[offset]);
 
       if (size >= 0 && size <= caption_max_size &&
-          srpc->sdp.data_size - offset >= c_header_size + size) {
-        memcpy(get_item_ptr(pack, a), &srpc->sdp.data[offset],
+          view->data_size - offset >= c_header_size + size) {
+        memcpy(get_item_ptr(pack, a), &view->data[offset],
                c_header_size + size);
         offset += c_header_size + size;
         pack_set_count(pack, 1, 1);
@@ -356,7 +965,6 @@ void SRPC_ICACHE_FLASH srpc_getpack(
     }
 
   if (count == pack_get_count(pack)) {
-    srpc->sdp.data_size = 0;
     // dcs_ping is 1st variable in union
     rd->data.dcs_ping = pack;
 
@@ -386,8 +994,9 @@ unsigned _supla_int_t srpc_channelpack_get_item_caption_size(void *item) {
   return ((TSC_SuplaChannel *)item)->CaptionSize;
 }
 
-void SRPC_ICACHE_FLASH srpc_getchannelpack(Tsrpc *srpc, TsrpcReceivedData *rd) {
-  srpc_getpack(srpc, rd, sizeof(TSC_SuplaChannelPack), sizeof(TSC_SuplaChannel),
+void SRPC_ICACHE_FLASH srpc_getchannelpack(TSuplaDataPacketView *view,
+                                           TsrpcReceivedData *rd) {
+  srpc_getpack(view, rd, sizeof(TSC_SuplaChannelPack), sizeof(TSC_SuplaChannel),
                SUPLA_CHANNELPACK_MAXCOUNT, SUPLA_CHANNEL_CAPTION_MAXSIZE,
                &srpc_channelpack_get_pack_count,
                &srpc_channelpack_set_pack_count, &srpc_channelpack_get_item_ptr,
@@ -415,10 +1024,10 @@ unsigned _supla_int_t srpc_channelpack_get_item_caption_size_b(void *item) {
   return ((TSC_SuplaChannel_B *)item)->CaptionSize;
 }
 
-void SRPC_ICACHE_FLASH srpc_getchannelpack_b(Tsrpc *srpc,
+void SRPC_ICACHE_FLASH srpc_getchannelpack_b(TSuplaDataPacketView *view,
                                              TsrpcReceivedData *rd) {
   srpc_getpack(
-      srpc, rd, sizeof(TSC_SuplaChannelPack_B), sizeof(TSC_SuplaChannel_B),
+      view, rd, sizeof(TSC_SuplaChannelPack_B), sizeof(TSC_SuplaChannel_B),
       SUPLA_CHANNELPACK_MAXCOUNT, SUPLA_CHANNEL_CAPTION_MAXSIZE,
       &srpc_channelpack_get_pack_count_b, &srpc_channelpack_set_pack_count_b,
       &srpc_channelpack_get_item_ptr_b,
@@ -446,9 +1055,9 @@ unsigned _supla_int_t srpc_channelgroup_pack_get_item_caption_size(void *item) {
   return ((TSC_SuplaChannelGroup *)item)->CaptionSize;
 }
 
-void SRPC_ICACHE_FLASH srpc_getchannelgroup_pack(Tsrpc *srpc,
+void SRPC_ICACHE_FLASH srpc_getchannelgroup_pack(TSuplaDataPacketView *view,
                                                  TsrpcReceivedData *rd) {
-  srpc_getpack(srpc, rd, sizeof(TSC_SuplaChannelGroupPack),
+  srpc_getpack(view, rd, sizeof(TSC_SuplaChannelGroupPack),
                sizeof(TSC_SuplaChannelGroup), SUPLA_CHANNELGROUP_PACK_MAXCOUNT,
                SUPLA_CHANNELGROUP_CAPTION_MAXSIZE,
                &srpc_channelgroup_pack_get_pack_count,
@@ -478,548 +1087,1038 @@ unsigned _supla_int_t srpc_locationpack_get_item_caption_size(void *item) {
   return ((TSC_SuplaLocation *)item)->CaptionSize;
 }
 
-void SRPC_ICACHE_FLASH srpc_getlocationpack(Tsrpc *srpc,
+void SRPC_ICACHE_FLASH srpc_getlocationpack(TSuplaDataPacketView *view,
                                             TsrpcReceivedData *rd) {
   srpc_getpack(
-      srpc, rd, sizeof(TSC_SuplaLocationPack), sizeof(TSC_SuplaLocation),
+      view, rd, sizeof(TSC_SuplaLocationPack), sizeof(TSC_SuplaLocation),
       SUPLA_LOCATIONPACK_MAXCOUNT, SUPLA_LOCATION_CAPTION_MAXSIZE,
       &srpc_locationpack_get_pack_count, &srpc_locationpack_set_pack_count,
       &srpc_locationpack_get_item_ptr,
       &srpc_locationpack_get_item_caption_size);
 }
 
-char SRPC_ICACHE_FLASH srpc_getdata(void *_srpc, TsrpcReceivedData *rd,
-                                    unsigned _supla_int_t rr_id) {
-  Tsrpc *srpc = (Tsrpc *)_srpc;
-  char call_with_no_data = 0;
-  rd->call_type = 0;
+#ifndef SRPC_EXCLUDE_CLIENT
 
-  lck_lock(srpc->lck);
+// Every compact pack starts with count and total_left, and every item ends
+// with CaptionSize followed by Caption
+typedef struct {
+  unsigned short call_type;
+  unsigned short pack_sizeof;
+  unsigned short item_sizeof;
+  unsigned short caption_max_size;
+  unsigned char max_count;
+} Tsrpc_PackType;
+
+#define SRPC_PACK_TYPE(call_type, pack, item, max_count, caption_max_size) \
+  { call_type, sizeof(pack), sizeof(item), caption_max_size, max_count }
+
+static const Tsrpc_PackType srpc_pack_types[] SRPC_TABLE_ATTR = {
+    SRPC_PACK_TYPE(SUPLA_SC_CALL_LOCATIONPACK_UPDATE, TSC_SuplaLocationPack,
+                   TSC_SuplaLocation, SUPLA_LOCATIONPACK_MAXCOUNT,
+                   SUPLA_LOCATION_CAPTION_MAXSIZE),
+    SRPC_PACK_TYPE(SUPLA_SC_CALL_CHANNELPACK_UPDATE, TSC_SuplaChannelPack,
+                   TSC_SuplaChannel, SUPLA_CHANNELPACK_MAXCOUNT,
+                   SUPLA_CHANNEL_CAPTION_MAXSIZE),
+    SRPC_PACK_TYPE(SUPLA_SC_CALL_CHANNELPACK_UPDATE_B, TSC_SuplaChannelPack_B,
+                   TSC_SuplaChannel_B, SUPLA_CHANNELPACK_MAXCOUNT,
+                   SUPLA_CHANNEL_CAPTION_MAXSIZE),
+    SRPC_PACK_TYPE(SUPLA_SC_CALL_CHANNELGROUP_PACK_UPDATE,
+                   TSC_SuplaChannelGroupPack, TSC_SuplaChannelGroup,
+                   SUPLA_CHANNELGROUP_PACK_MAXCOUNT,
+                   SUPLA_CHANNELGROUP_CAPTION_MAXSIZE)};
+
+// Caption size of the item at offset, 0 if the item is truncated or invalid
+static unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_pack_item_size(TsrpcPackIterator *it, unsigned _supla_int_t offset) {
+  unsigned _supla_int_t caption_size;
+
+  if (it->data_size - offset < it->item_header_size) {
+    return 0;
+  }
 
-  if (SUPLA_RESULT_TRUE == srpc_in_queue_pop(srpc, &srpc->sdp, rr_id)) {
-    rd->call_type = srpc->sdp.call_type;
-    rd->rr_id = srpc->sdp.rr_id;
+  memcpy(&caption_size,
+         &it->data[offset + it->item_header_size - sizeof(caption_size)],
+         sizeof(caption_size));
 
-    // first one
-    rd->data.dcs_ping = NULL;
+  if (caption_size > it->caption_max_size ||
+      it->data_size - offset - it->item_header_size < caption_size) {
+    return 0;
+  }
 
-    switch (srpc->sdp.call_type) {
-      case SUPLA_DCS_CALL_GETVERSION:
-      case SUPLA_CS_CALL_GET_NEXT:
-      case SUPLA_DCS_CALL_GET_REGISTRATION_ENABLED:
-        call_with_no_data = 1;
-        break;
+  return it->item_header_size + caption_size;
+}
 
-      case SUPLA_SDC_CALL_GETVERSION_RESULT:
+char SRPC_ICACHE_FLASH srpc_pack_iterator_init(
+    TsrpcPackIterator *it, const TSuplaDataPacketView *view) {
+  Tsrpc_PackType pt;
+  unsigned _supla_int_t a, header_size, offset, size;
 
-        if (srpc->sdp.data_size == sizeof(TSDC_SuplaGetVersionResult))
-          rd->data.sdc_getversion_result = (TSDC_SuplaGetVersionResult *)malloc(
-              sizeof(TSDC_SuplaGetVersionResult));
+  memset(it, 0, sizeof(TsrpcPackIterator));
 
-        break;
+  for (a = 0; a < sizeof(srpc_pack_types) / sizeof(Tsrpc_PackType); a++) {
+    srpc_table_read(&pt, &srpc_pack_types[a], sizeof(Tsrpc_PackType));
+    if (pt.call_type == view->call_type) break;
+  }
 
-      case SUPLA_SDC_CALL_VERSIONERROR:
+  if (pt.call_type != view->call_type) {
+    return SUPLA_RESULT_FALSE;
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSDC_SuplaVersionError))
-          rd->data.sdc_version_error =
-              (TSDC_SuplaVersionError *)malloc(sizeof(TSDC_SuplaVersionError));
+  header_size = pt.pack_sizeof - pt.item_sizeof * pt.max_count;
 
-        break;
+  if (view->data_size < header_size || view->data_size > pt.pack_sizeof) {
+    return SUPLA_RESULT_FALSE;
+  }
 
-      case SUPLA_DCS_CALL_PING_SERVER:
+  memcpy(&it->count, view->data, sizeof(it->count));
+  memcpy(&it->total_left, &view->data[sizeof(it->count)],
+         sizeof(it->total_left));
 
-        if (srpc->sdp.data_size == sizeof(TDCS_SuplaPingServer))
-          rd->data.dcs_ping =
-              (TDCS_SuplaPingServer *)malloc(sizeof(TDCS_SuplaPingServer));
+  if (it->count < 0 || it->count > pt.max_count) {
+    return SUPLA_RESULT_FALSE;
+  }
 
-        break;
+  it->data = view->data;
+  it->data_size = view->data_size;
+  it->item_header_size = pt.item_sizeof - pt.caption_max_size;
+  it->caption_max_size = pt.caption_max_size;
+
+  // All or nothing, as with the expanded pack
+  offset = header_size;
 
-      case SUPLA_SDC_CALL_PING_SERVER_RESULT:
+  for (a = 0; a < it->count; a++) {
+    if ((size = srpc_pack_item_size(it, offset)) == 0) {
+      it->count = 0;
+      return SUPLA_RESULT_FALSE;
+    }
+    offset += size;
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSDC_SuplaPingServerResult))
-          rd->data.sdc_ping_result = (TSDC_SuplaPingServerResult *)malloc(
-              sizeof(TSDC_SuplaPingServerResult));
+  it->offset = header_size;
+  return SUPLA_RESULT_TRUE;
+}
 
-        break;
+char SRPC_ICACHE_FLASH srpc_pack_iterator_next(TsrpcPackIterator *it,
+                                               TsrpcPackItem *item) {
+  unsigned _supla_int_t size;
+
+  if (it->idx >= it->count) {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  size = srpc_pack_item_size(it, it->offset);
+
+  item->item = &it->data[it->offset];
+  item->caption = &it->data[it->offset + it->item_header_size];
+  item->caption_size = size - it->item_header_size;
+
+  it->offset += size;
+  it->idx++;
+
+  return SUPLA_RESULT_TRUE;
+}
+
+#endif /*SRPC_EXCLUDE_CLIENT*/
+
+#define SRPC_CALL_NO_DATA 0x01
+#define SRPC_CALL_MIN_OR_MAX 0x02  // exactly min_size or max_size bytes
+#define SRPC_CALL_LANE(lane) ((lane) << 2)
+#define SRPC_CALL_GET_LANE(flags) (((flags) >> 2) & 0x03)
+
+typedef void (*_func_srpc_unpack)(TSuplaDataPacketView *view,
+                                  TsrpcReceivedData *rd);
+
+typedef struct {
+  unsigned short call_type;
+  unsigned char min_version;
+  unsigned char flags;
+  unsigned short min_size;
+  unsigned short max_size;  // size of the decoded struct
+  _func_srpc_unpack unpack;  // packs, validated and decoded by the function
+} Tsrpc_CallType;
+
+#define SRPC_CALL_NODATA(call_type, min_version, lane)                      \
+  {                                                                         \
+    call_type, min_version, SRPC_CALL_NO_DATA | SRPC_CALL_LANE(lane), 0, 0, \
+        NULL                                                                \
+  }
+#define SRPC_CALL_FIXED(call_type, min_version, type, lane)                   \
+  {                                                                           \
+    call_type, min_version, SRPC_CALL_LANE(lane), sizeof(type), sizeof(type), \
+        NULL                                                                  \
+  }
+#define SRPC_CALL_VAR(call_type, min_version, type, min_size, lane)            \
+  {                                                                            \
+    call_type, min_version, SRPC_CALL_LANE(lane), min_size, sizeof(type), NULL \
+  }
+#define SRPC_CALL_PACK(call_type, min_version, unpack, lane) \
+  { call_type, min_version, SRPC_CALL_LANE(lane), 0, 0, unpack }
+
+// Sorted by call_type
+static const Tsrpc_CallType srpc_call_types[] SRPC_TABLE_ATTR = {
+    SRPC_CALL_NODATA(SUPLA_DCS_CALL_GETVERSION, 1, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SDC_CALL_GETVERSION_RESULT, 1,
+                    TSDC_SuplaGetVersionResult, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SDC_CALL_VERSIONERROR, 1, TSDC_SuplaVersionError,
+                    SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_DCS_CALL_PING_SERVER, 1, TDCS_SuplaPingServer,
+                    SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SDC_CALL_PING_SERVER_RESULT, 1,
+                    TSDC_SuplaPingServerResult, SRPC_LANE_CONTROL),
+#ifndef SRPC_EXCLUDE_DEVICE
+    SRPC_CALL_VAR(SUPLA_DS_CALL_REGISTER_DEVICE, 1, TDS_SuplaRegisterDevice,
+                  sizeof(TDS_SuplaRegisterDevice) -
+                      (sizeof(TDS_SuplaDeviceChannel) * SUPLA_CHANNELMAXCOUNT),
+                  SRPC_LANE_CONTROL),
+    SRPC_CALL_VAR(SUPLA_DS_CALL_REGISTER_DEVICE_B, 2, TDS_SuplaRegisterDevice_B,
+                  sizeof(TDS_SuplaRegisterDevice_B) -
+                      (sizeof(TDS_SuplaDeviceChannel_B) *
+                       SUPLA_CHANNELMAXCOUNT),
+                  SRPC_LANE_CONTROL),
+    SRPC_CALL_VAR(SUPLA_DS_CALL_REGISTER_DEVICE_C, 6, TDS_SuplaRegisterDevice_C,
+                  sizeof(TDS_SuplaRegisterDevice_C) -
+                      (sizeof(TDS_SuplaDeviceChannel_B) *
+                       SUPLA_CHANNELMAXCOUNT),
+                  SRPC_LANE_CONTROL),
+    SRPC_CALL_VAR(SUPLA_DS_CALL_REGISTER_DEVICE_D, 7, TDS_SuplaRegisterDevice_D,
+                  sizeof(TDS_SuplaRegisterDevice_D) -
+                      (sizeof(TDS_SuplaDeviceChannel_B) *
+                       SUPLA_CHANNELMAXCOUNT),
+                  SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SD_CALL_REGISTER_DEVICE_RESULT, 1,
+                    TSD_SuplaRegisterDeviceResult, SRPC_LANE_CONTROL),
+#endif /*SRPC_EXCLUDE_DEVICE*/
+#ifndef SRPC_EXCLUDE_CLIENT
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_REGISTER_CLIENT, 1, TCS_SuplaRegisterClient,
+                    SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_REGISTER_CLIENT_B, 6,
+                    TCS_SuplaRegisterClient_B, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_REGISTER_CLIENT_C, 7,
+                    TCS_SuplaRegisterClient_C, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SC_CALL_REGISTER_CLIENT_RESULT, 1,
+                    TSC_SuplaRegisterClientResult, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SC_CALL_REGISTER_CLIENT_RESULT_B, 9,
+                    TSC_SuplaRegisterClientResult_B, SRPC_LANE_CONTROL),
+#endif /*SRPC_EXCLUDE_CLIENT*/
+#ifndef SRPC_EXCLUDE_DEVICE
+    SRPC_CALL_FIXED(SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED, 1,
+                    TDS_SuplaDeviceChannelValue, SRPC_LANE_DATA),
+    SRPC_CALL_FIXED(SUPLA_SD_CALL_CHANNEL_SET_VALUE, 1,
+                    TSD_SuplaChannelNewValue, SRPC_LANE_STATE),
+    SRPC_CALL_FIXED(SUPLA_DS_CALL_CHANNEL_SET_VALUE_RESULT, 1,
+                    TDS_SuplaChannelNewValueResult, SRPC_LANE_STATE),
+#endif /*SRPC_EXCLUDE_DEVICE*/
+#ifndef SRPC_EXCLUDE_CLIENT
+    SRPC_CALL_VAR(SUPLA_SC_CALL_LOCATION_UPDATE, 1, TSC_SuplaLocation,
+                  sizeof(TSC_SuplaLocation) - SUPLA_LOCATION_CAPTION_MAXSIZE,
+                  SRPC_LANE_STATE),
+    SRPC_CALL_PACK(SUPLA_SC_CALL_LOCATIONPACK_UPDATE, 1,
+                   &srpc_getlocationpack, SRPC_LANE_STATE),
+    SRPC_CALL_VAR(SUPLA_SC_CALL_CHANNEL_UPDATE, 1, TSC_SuplaChannel,
+                  sizeof(TSC_SuplaChannel) - SUPLA_CHANNEL_CAPTION_MAXSIZE,
+                  SRPC_LANE_STATE),
+    SRPC_CALL_PACK(SUPLA_SC_CALL_CHANNELPACK_UPDATE, 1, &srpc_getchannelpack,
+                   SRPC_LANE_STATE),
+    SRPC_CALL_FIXED(SUPLA_SC_CALL_CHANNEL_VALUE_UPDATE, 1,
+                    TSC_SuplaChannelValue, SRPC_LANE_DATA),
+#endif /*SRPC_EXCLUDE_CLIENT*/
+    // Handled on both sides like before
+    SRPC_CALL_NODATA(SUPLA_CS_CALL_GET_NEXT, 1, SRPC_LANE_STATE),
+#ifndef SRPC_EXCLUDE_CLIENT
+    SRPC_CALL_VAR(SUPLA_SC_CALL_EVENT, 1, TSC_SuplaEvent,
+                  sizeof(TSC_SuplaEvent) - SUPLA_SENDER_NAME_MAXSIZE,
+                  SRPC_LANE_STATE),
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_CHANNEL_SET_VALUE, 1,
+                    TCS_SuplaChannelNewValue, SRPC_LANE_STATE),
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_CHANNEL_SET_VALUE_B, 3,
+                    TCS_SuplaChannelNewValue_B, SRPC_LANE_STATE),
+#endif /*SRPC_EXCLUDE_CLIENT*/
+    SRPC_CALL_FIXED(SUPLA_DCS_CALL_SET_ACTIVITY_TIMEOUT, 2,
+                    TDCS_SuplaSetActivityTimeout, SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SDC_CALL_SET_ACTIVITY_TIMEOUT_RESULT, 2,
+                    TSDC_SuplaSetActivityTimeoutResult, SRPC_LANE_CONTROL),
+#ifndef SRPC_EXCLUDE_DEVICE
+    SRPC_CALL_FIXED(SUPLA_DS_CALL_GET_FIRMWARE_UPDATE_URL, 5,
+                    TDS_FirmwareUpdateParams, SRPC_LANE_STATE),
+    // A single byte means there is no update
+    {SUPLA_SD_CALL_GET_FIRMWARE_UPDATE_URL_RESULT, 5,
+     SRPC_CALL_MIN_OR_MAX | SRPC_CALL_LANE(SRPC_LANE_STATE), sizeof(char),
+     sizeof(TSD_FirmwareUpdate_UrlResult), NULL},
+#endif /*SRPC_EXCLUDE_DEVICE*/
+    SRPC_CALL_NODATA(SUPLA_DCS_CALL_GET_REGISTRATION_ENABLED, 7,
+                     SRPC_LANE_CONTROL),
+    SRPC_CALL_FIXED(SUPLA_SDC_CALL_GET_REGISTRATION_ENABLED_RESULT, 7,
+                    TSDC_RegistrationEnabled, SRPC_LANE_CONTROL),
+#ifndef SRPC_EXCLUDE_CLIENT
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_GET_OAUTH_PARAMETERS, 7,
+                    TCS_OAuthParametersRequest, SRPC_LANE_STATE),
+    SRPC_CALL_FIXED(SUPLA_SC_CALL_GET_OAUTH_PARAMETERS_RESULT, 7,
+                    TSC_OAuthParameters, SRPC_LANE_STATE),
+    SRPC_CALL_PACK(SUPLA_SC_CALL_CHANNELPACK_UPDATE_B, 8,
+                   &srpc_getchannelpack_b, SRPC_LANE_STATE),
+    SRPC_CALL_VAR(SUPLA_SC_CALL_CHANNEL_UPDATE_B, 8, TSC_SuplaChannel_B,
+                  sizeof(TSC_SuplaChannel_B) - SUPLA_CHANNEL_CAPTION_MAXSIZE,
+                  SRPC_LANE_STATE),
+    SRPC_CALL_PACK(SUPLA_SC_CALL_CHANNELGROUP_PACK_UPDATE, 9,
+                   &srpc_getchannelgroup_pack, SRPC_LANE_STATE),
+    SRPC_CALL_VAR(SUPLA_SC_CALL_CHANNELGROUP_RELATION_PACK_UPDATE, 9,
+                  TSC_SuplaChannelGroupRelationPack,
+                  sizeof(TSC_SuplaChannelGroupRelationPack) -
+                      (sizeof(TSC_SuplaChannelGroupRelation) *
+                       SUPLA_CHANNELGROUP_RELATION_PACK_MAXCOUNT),
+                  SRPC_LANE_STATE),
+    SRPC_CALL_VAR(SUPLA_SC_CALL_CHANNELVALUE_PACK_UPDATE, 9,
+                  TSC_SuplaChannelValuePack,
+                  sizeof(TSC_SuplaChannelValuePack) -
+                      (sizeof(TSC_SuplaChannelValue) *
+                       SUPLA_CHANNELVALUE_PACK_MAXCOUNT),
+                  SRPC_LANE_DATA),
+    SRPC_CALL_FIXED(SUPLA_CS_CALL_SET_VALUE, 9, TCS_SuplaNewValue,
+                    SRPC_LANE_STATE),
+#endif /*SRPC_EXCLUDE_CLIENT*/
+};
+
+#define SRPC_CALL_TYPE_COUNT \
+  (sizeof(srpc_call_types) / sizeof(Tsrpc_CallType))
+
+#if !defined(ESP8266) && !defined(__AVR__)
+static char srpc_call_types_sorted(void) {
+  unsigned _supla_int_t a;
+
+  for (a = 1; a < SRPC_CALL_TYPE_COUNT; a++) {
+    if (srpc_call_types[a - 1].call_type >= srpc_call_types[a].call_type) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+#endif
+
+// Returns the table index of call_type and copies the entry to ct, or -1
+static _supla_int_t SRPC_ICACHE_FLASH
+srpc_call_type_find(unsigned _supla_int_t call_type, Tsrpc_CallType *ct) {
+  _supla_int_t first = 0;
+  _supla_int_t last = SRPC_CALL_TYPE_COUNT - 1;
+  _supla_int_t mid;
+
+  while (first <= last) {
+    mid = (first + last) / 2;
+    srpc_table_read(ct, &srpc_call_types[mid], sizeof(Tsrpc_CallType));
+
+    if (ct->call_type == call_type) {
+      return mid;
+    } else if (ct->call_type < call_type) {
+      first = mid + 1;
+    } else {
+      last = mid - 1;
+    }
+  }
+
+  return -1;
+}
+
+// Decodes a packet into rd. With borrow set, payloads of the exact struct size
+// point straight into view->data instead of being copied. Otherwise the
+// payload goes to rd->inline_data, the arena or the heap, whichever fits first.
+static char SRPC_ICACHE_FLASH
+srpc_view_decode(TSuplaDataPacketView *view, TsrpcReceivedData *rd,
+                 unsigned char borrow, void *arena,
+                 unsigned _supla_int_t arena_size) {
+  unsigned _supla_int_t alloc_size = 0;
+  Tsrpc_CallType ct;
+
+  rd->call_type = view->call_type;
+  rd->rr_id = view->rr_id;
+  rd->storage = SRPC_RD_STORAGE_HEAP;
+
+  // first one
+  rd->data.dcs_ping = NULL;
+
+  if (srpc_call_type_find(view->call_type, &ct) < 0) {
+    return SUPLA_RESULT_DATA_ERROR;
+  }
+
+  if (ct.flags & SRPC_CALL_NO_DATA) {
+    return SUPLA_RESULT_TRUE;
+  }
+
+  if (ct.unpack != NULL) {
+    ct.unpack(view, rd);
+  } else if ((ct.flags & SRPC_CALL_MIN_OR_MAX)
+                 ? (view->data_size == ct.min_size ||
+                    view->data_size == ct.max_size)
+                 : (view->data_size >= ct.min_size &&
+                    view->data_size <= ct.max_size)) {
+    alloc_size = ct.max_size;
+  }
+
+  if (alloc_size > 0) {
+    if (borrow && view->data_size == alloc_size) {
+      rd->data.dcs_ping = (TDCS_SuplaPingServer *)view->data;
+      rd->storage = SRPC_RD_STORAGE_BORROWED;
+    } else {
+      if (alloc_size <= sizeof(rd->inline_data)) {
+        rd->data.dcs_ping = (TDCS_SuplaPingServer *)&rd->inline_data;
+        rd->storage = SRPC_RD_STORAGE_INLINE;
+      } else if (arena != NULL && alloc_size <= arena_size) {
+        rd->data.dcs_ping = (TDCS_SuplaPingServer *)arena;
+        rd->storage = SRPC_RD_STORAGE_ARENA;
+      } else {
+        rd->data.dcs_ping = (TDCS_SuplaPingServer *)malloc(alloc_size);
+      }
+
+      if (rd->data.dcs_ping != NULL) {
+        if (view->data_size > 0)
+          memcpy(rd->data.dcs_ping, view->data, view->data_size);
+
+        if (view->data_size < alloc_size)
+          memset(&((char *)rd->data.dcs_ping)[view->data_size], 0,
+                 alloc_size - view->data_size);
+      }
+    }
+  }
+
+  return rd->data.dcs_ping != NULL ? SUPLA_RESULT_TRUE
+                                   : SUPLA_RESULT_DATA_ERROR;
+}
+
+static char SRPC_ICACHE_FLASH srpc_take_view(Tsrpc *srpc,
+                                             TSuplaDataPacketView *view,
+                                             unsigned _supla_int_t rr_id) {
+  if (srpc->in_view_available &&
+      (rr_id == 0 || srpc->in_view.rr_id == rr_id)) {
+    srpc->in_view_available = 0;
+    memcpy(view, &srpc->in_view, sizeof(TSuplaDataPacketView));
+    return SUPLA_RESULT_TRUE;
+  }
+
+  return SUPLA_RESULT_FALSE;
+}
+
+char SRPC_ICACHE_FLASH srpc_getview(void *_srpc, TSuplaDataPacketView *view,
+                                    unsigned _supla_int_t rr_id) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+
+  lck_lock(srpc->in_lck);
+  return lck_unlock_r(srpc->in_lck, srpc_take_view(srpc, view, rr_id));
+}
+
+static char SRPC_ICACHE_FLASH srpc__getdata(void *_srpc, TsrpcReceivedData *rd,
+                                            unsigned _supla_int_t rr_id,
+                                            unsigned char borrow, void *arena,
+                                            unsigned _supla_int_t arena_size) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  TSuplaDataPacketView view;
+  char result;
+  rd->call_type = 0;
+
+  lck_lock(srpc->in_lck);
+
+  if (SUPLA_RESULT_TRUE == srpc_take_view(srpc, &view, rr_id)) {
+    result = srpc_view_decode(&view, rd, borrow, arena, arena_size);
+  } else if (SUPLA_RESULT_TRUE ==
+             srpc_in_queue_pop(srpc, &srpc->in_sdp, rr_id)) {
+    view.version = srpc->in_sdp.version;
+    view.rr_id = srpc->in_sdp.rr_id;
+    view.call_type = srpc->in_sdp.call_type;
+    view.data_size = srpc->in_sdp.data_size;
+    view.data = srpc->in_sdp.data;
+
+    result = srpc_view_decode(&view, rd, 0, arena, arena_size);
+  } else {
+    return lck_unlock_r(srpc->in_lck, SUPLA_RESULT_FALSE);
+  }
 
-      case SUPLA_DCS_CALL_SET_ACTIVITY_TIMEOUT:
+  if (result != SUPLA_RESULT_TRUE) {
+    srpc_stats_error(srpc, view.call_type, result);
+  }
 
-        if (srpc->sdp.data_size == sizeof(TDCS_SuplaSetActivityTimeout))
-          rd->data.dcs_set_activity_timeout =
-              (TDCS_SuplaSetActivityTimeout *)malloc(
-                  sizeof(TDCS_SuplaSetActivityTimeout));
+  return lck_unlock_r(srpc->in_lck, result);
+}
 
-        break;
+char SRPC_ICACHE_FLASH srpc_getdata(void *_srpc, TsrpcReceivedData *rd,
+                                    unsigned _supla_int_t rr_id) {
+  return srpc__getdata(_srpc, rd, rr_id, 0, NULL, 0);
+}
 
-      case SUPLA_SDC_CALL_SET_ACTIVITY_TIMEOUT_RESULT:
+char SRPC_ICACHE_FLASH srpc_getdata_ex(void *_srpc, TsrpcReceivedData *rd,
+                                       unsigned _supla_int_t rr_id, void *arena,
+                                       unsigned _supla_int_t arena_size) {
+  return srpc__getdata(_srpc, rd, rr_id, 0, arena, arena_size);
+}
 
-        if (srpc->sdp.data_size == sizeof(TSDC_SuplaSetActivityTimeoutResult))
-          rd->data.sdc_set_activity_timeout_result =
-              (TSDC_SuplaSetActivityTimeoutResult *)malloc(
-                  sizeof(TSDC_SuplaSetActivityTimeoutResult));
+char SRPC_ICACHE_FLASH srpc_getdata_borrowed(void *_srpc,
+                                             TsrpcReceivedData *rd,
+                                             unsigned _supla_int_t rr_id) {
+  return srpc__getdata(_srpc, rd, rr_id, 1, NULL, 0);
+}
 
-        break;
+void SRPC_ICACHE_FLASH srpc_rd_free(TsrpcReceivedData *rd) {
+  if (rd->call_type > 0) {
+    // first one
 
-      case SUPLA_SDC_CALL_GET_REGISTRATION_ENABLED_RESULT:
+    if (rd->data.dcs_ping != NULL && rd->storage == SRPC_RD_STORAGE_HEAP)
+      free(rd->data.dcs_ping);
 
-        if (srpc->sdp.data_size == sizeof(TSDC_RegistrationEnabled))
-          rd->data.sdc_reg_enabled = (TSDC_RegistrationEnabled *)malloc(
-              sizeof(TSDC_RegistrationEnabled));
+    rd->call_type = 0;
+  }
+}
 
-        break;
-#ifndef SRPC_EXCLUDE_DEVICE
-      case SUPLA_DS_CALL_REGISTER_DEVICE:
-
-        if (srpc->sdp.data_size >=
-                (sizeof(TDS_SuplaRegisterDevice) -
-                 (sizeof(TDS_SuplaDeviceChannel) * SUPLA_CHANNELMAXCOUNT)) &&
-            srpc->sdp.data_size <= sizeof(TDS_SuplaRegisterDevice)) {
-          rd->data.ds_register_device = (TDS_SuplaRegisterDevice *)malloc(
-              sizeof(TDS_SuplaRegisterDevice));
-        }
+unsigned char SRPC_ICACHE_FLASH
+srpc_call_min_version_required(void *_srpc, unsigned _supla_int_t call_type) {
+  Tsrpc_CallType ct;
 
-        break;
+  if (srpc_call_type_find(call_type, &ct) >= 0) {
+    return ct.min_version;
+  }
 
-      case SUPLA_DS_CALL_REGISTER_DEVICE_B:  // ver. >= 2
+  return 255;
+}
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TDS_SuplaRegisterDevice_B) -
-                 (sizeof(TDS_SuplaDeviceChannel_B) * SUPLA_CHANNELMAXCOUNT)) &&
-            srpc->sdp.data_size <= sizeof(TDS_SuplaRegisterDevice_B)) {
-          rd->data.ds_register_device_b = (TDS_SuplaRegisterDevice_B *)malloc(
-              sizeof(TDS_SuplaRegisterDevice_B));
-        }
+static unsigned char SRPC_ICACHE_FLASH
+srpc_call_lane(unsigned _supla_int_t call_type) {
+  Tsrpc_CallType ct;
 
-        break;
+  if (srpc_call_type_find(call_type, &ct) >= 0) {
+    return SRPC_CALL_GET_LANE(ct.flags);
+  }
 
-      case SUPLA_DS_CALL_REGISTER_DEVICE_C:  // ver. >= 6
+  return SRPC_LANE_STATE;
+}
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TDS_SuplaRegisterDevice_C) -
-                 (sizeof(TDS_SuplaDeviceChannel_B) * SUPLA_CHANNELMAXCOUNT)) &&
-            srpc->sdp.data_size <= sizeof(TDS_SuplaRegisterDevice_C)) {
-          rd->data.ds_register_device_c = (TDS_SuplaRegisterDevice_C *)malloc(
-              sizeof(TDS_SuplaRegisterDevice_C));
-        }
+unsigned char SRPC_ICACHE_FLASH
+srpc_call_allowed(void *_srpc, unsigned _supla_int_t call_type) {
+  unsigned char min_ver = srpc_call_min_version_required(_srpc, call_type);
 
-        break;
+  if (min_ver == 0 || srpc_get_proto_version(_srpc) >= min_ver) {
+    return 1;
+  }
 
-      case SUPLA_DS_CALL_REGISTER_DEVICE_D:  // ver. >= 7
+  return 0;
+}
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TDS_SuplaRegisterDevice_D) -
-                 (sizeof(TDS_SuplaDeviceChannel_B) * SUPLA_CHANNELMAXCOUNT)) &&
-            srpc->sdp.data_size <= sizeof(TDS_SuplaRegisterDevice_D)) {
-          rd->data.ds_register_device_d = (TDS_SuplaRegisterDevice_D *)malloc(
-              sizeof(TDS_SuplaRegisterDevice_D));
-        }
+static _supla_int_t SRPC_ICACHE_FLASH
+srpc_async_call_begin(Tsrpc *srpc, unsigned _supla_int_t call_type) {
+  if (!srpc_call_allowed(srpc, call_type)) {
+    if (srpc->params.on_min_version_required != NULL) {
+      srpc->params.on_min_version_required(
+          srpc, call_type, srpc_call_min_version_required(srpc, call_type),
+          srpc->params.user_params);
+    }
 
-        break;
+    return SUPLA_RESULT_CALL_NOT_ALLOWED;
+  }
 
-      case SUPLA_SD_CALL_REGISTER_DEVICE_RESULT:
+  if (srpc->params.before_async_call != NULL) {
+    srpc->params.before_async_call(srpc, call_type, srpc->params.user_params);
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSD_SuplaRegisterDeviceResult))
-          rd->data.sd_register_device_result =
-              (TSD_SuplaRegisterDeviceResult *)malloc(
-                  sizeof(TSD_SuplaRegisterDeviceResult));
-        break;
+  return SUPLA_RESULT_TRUE;
+}
 
-      case SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED:
 
-        if (srpc->sdp.data_size == sizeof(TDS_SuplaDeviceChannelValue))
-          rd->data.ds_device_channel_value =
-              (TDS_SuplaDeviceChannelValue *)malloc(
-                  sizeof(TDS_SuplaDeviceChannelValue));
+// Tells whether any packet waits in the out queue in the given lane or in a
+// more urgent one
+static char SRPC_ICACHE_FLASH srpc_out_queued_ahead(Tsrpc *srpc,
+                                                    unsigned char lane) {
+  unsigned char a;
 
-        break;
+  for (a = 0; a <= lane; a++) {
+    if (srpc->out_queue.lane_head[a] != 0) {
+      return SUPLA_RESULT_TRUE;
+    }
+  }
 
-      case SUPLA_SD_CALL_CHANNEL_SET_VALUE:
+  return SUPLA_RESULT_FALSE;
+}
 
-        if (srpc->sdp.data_size == sizeof(TSD_SuplaChannelNewValue))
-          rd->data.sd_channel_new_value = (TSD_SuplaChannelNewValue *)malloc(
-              sizeof(TSD_SuplaChannelNewValue));
+// Makes room for a call of a more urgent lane. The owner learns which packet
+// is gone, so it can send it again. The caller holds the lock
+static void SRPC_ICACHE_FLASH srpc_out_drop(Tsrpc *srpc,
+                                            unsigned _supla_int_t idx,
+                                            unsigned _supla_int_t call_type) {
+  Tsrpc_QueueSlot *slot = &srpc->out_queue.slot[idx];
 
-        break;
+  supla_log(LOG_DEBUG, "Out queue full. Call %i dropped queued call %i",
+            call_type, slot->sdp->call_type);
+  srpc_stats_refused(srpc, slot->sdp->call_type, 1);
 
-      case SUPLA_DS_CALL_CHANNEL_SET_VALUE_RESULT:
+  if (srpc->params.on_out_dropped != NULL) {
+    srpc->params.on_out_dropped(srpc, slot->sdp, slot->lane,
+                                srpc->params.user_params);
+  }
 
-        if (srpc->sdp.data_size == sizeof(TDS_SuplaChannelNewValueResult))
-          rd->data.ds_channel_new_value_result =
-              (TDS_SuplaChannelNewValueResult *)malloc(
-                  sizeof(TDS_SuplaChannelNewValueResult));
+  srpc_queue_remove(&srpc->out_queue, idx,
+                    srpc_queue_index_pos(&srpc->out_queue, idx));
+}
 
-        break;
+// The caller holds the lock
+static char *SRPC_ICACHE_FLASH srpc_out__reserve(
+    Tsrpc *srpc, unsigned _supla_int_t call_type, unsigned char lane,
+    unsigned _supla_int_t data_size) {
+  unsigned _supla_int_t size =
+      sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE + data_size;
+  unsigned _supla_int_t victim;
 
-      case SUPLA_DS_CALL_GET_FIRMWARE_UPDATE_URL:
+  if (data_size > SUPLA_MAX_DATA_SIZE) {
+    return NULL;
+  }
 
-        if (srpc->sdp.data_size == sizeof(TDS_FirmwareUpdateParams))
-          rd->data.ds_firmware_update_params =
-              (TDS_FirmwareUpdateParams *)malloc(
-                  sizeof(TDS_FirmwareUpdateParams));
+  if (lane >= SRPC_LANE_COUNT) {
+    lane = srpc_call_lane(call_type);
+  }
 
-        break;
+  srpc->out_sdp = NULL;
 
-      case SUPLA_SD_CALL_GET_FIRMWARE_UPDATE_URL_RESULT:
+  // Packets of less urgent lanes still in the queue are overtaken
+  if (!srpc_out_queued_ahead(srpc, lane)) {
+    srpc->out_sdp = sproto_out_buffer_reserve(srpc->proto, data_size);
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSD_FirmwareUpdate_UrlResult) ||
-            srpc->sdp.data_size == sizeof(char)) {
-          rd->data.sc_firmware_update_url_result =
-              (TSD_FirmwareUpdate_UrlResult *)malloc(
-                  sizeof(TSD_FirmwareUpdate_UrlResult));
+  srpc->out_sdp_queued = srpc->out_sdp == NULL;
 
-          if (srpc->sdp.data_size == sizeof(char) &&
-              rd->data.sc_firmware_update_url_result != NULL)
-            memset(rd->data.sc_firmware_update_url_result, 0,
-                   sizeof(TSD_FirmwareUpdate_UrlResult));
-        }
+  if (srpc->out_sdp_queued) {
+    srpc->out_sdp = srpc_queue_reserve(&srpc->out_queue, size);
 
-        break;
-#endif /*#ifndef SRPC_EXCLUDE_DEVICE*/
+    if (srpc->out_sdp == NULL && size <= sizeof(TSuplaDataPacket) &&
+        srpc_queue_victim(&srpc->out_queue, lane, &victim) ==
+            SUPLA_RESULT_TRUE) {
+      srpc_out_drop(srpc, victim, call_type);
+      srpc->out_sdp = srpc_queue_reserve(&srpc->out_queue, size);
+    }
 
-#ifndef SRPC_EXCLUDE_CLIENT
-      case SUPLA_CS_CALL_REGISTER_CLIENT:
+    if (srpc->out_sdp == NULL) {
+      srpc_stats_refused(srpc, call_type, 0);
+      srpc->out_blocked = 1;
+      return NULL;
+    }
+  }
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaRegisterClient))
-          rd->data.cs_register_client = (TCS_SuplaRegisterClient *)malloc(
-              sizeof(TCS_SuplaRegisterClient));
+  srpc->out_lane = lane;
+  srpc->out_call_type = call_type;
+  srpc->out_data_size = data_size;
 
-        break;
+  return srpc->out_sdp->data;
+}
 
-      case SUPLA_CS_CALL_REGISTER_CLIENT_B:  // ver. >= 6
+// The header is filled in only now, so rr_ids follow the commit order
+static _supla_int_t SRPC_ICACHE_FLASH
+srpc_out__commit(Tsrpc *srpc, unsigned char *version) {
+  TSuplaDataPacket *sdp = srpc->out_sdp;
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaRegisterClient_B))
-          rd->data.cs_register_client_b = (TCS_SuplaRegisterClient_B *)malloc(
-              sizeof(TCS_SuplaRegisterClient_B));
+  srpc->out_sdp = NULL;
 
-        break;
+  sproto_sdp_init(srpc->proto, sdp);
 
-      case SUPLA_CS_CALL_REGISTER_CLIENT_C:  // ver. >= 7
+  if (version != NULL) sdp->version = *version;
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaRegisterClient_C))
-          rd->data.cs_register_client_c = (TCS_SuplaRegisterClient_C *)malloc(
-              sizeof(TCS_SuplaRegisterClient_C));
+  sdp->call_type = srpc->out_call_type;
+  sdp->data_size = srpc->out_data_size;
 
-        break;
+  srpc_stats_commit(srpc, sdp);
 
-      case SUPLA_SC_CALL_REGISTER_CLIENT_RESULT:
+  if (srpc->out_sdp_queued) {
+    srpc_queue_commit(&srpc->out_queue, srpc->out_lane);
+  } else {
+    sproto_out_buffer_commit(srpc->proto, sdp);
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSC_SuplaRegisterClientResult))
-          rd->data.sc_register_client_result =
-              (TSC_SuplaRegisterClientResult *)malloc(
-                  sizeof(TSC_SuplaRegisterClientResult));
+  srpc_raise_event(srpc);
 
-        break;
+  return sdp->rr_id;
+}
 
-      case SUPLA_SC_CALL_REGISTER_CLIENT_RESULT_B:
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_reserve_ex(
+    void *_srpc, unsigned _supla_int_t call_type, unsigned char lane,
+    unsigned _supla_int_t data_size, char **data) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  _supla_int_t result = srpc_async_call_begin(srpc, call_type);
 
-        if (srpc->sdp.data_size == sizeof(TSC_SuplaRegisterClientResult_B))
-          rd->data.sc_register_client_result_b =
-              (TSC_SuplaRegisterClientResult_B *)malloc(
-                  sizeof(TSC_SuplaRegisterClientResult_B));
+  if (result != SUPLA_RESULT_TRUE) {
+    return result;
+  }
 
-        break;
+  lck_lock(srpc->out_lck);
 
-      case SUPLA_SC_CALL_LOCATION_UPDATE:
+  if ((*data = srpc_out__reserve(srpc, call_type, lane, data_size)) == NULL) {
+    return lck_unlock_r(srpc->out_lck, SUPLA_RESULT_FALSE);
+  }
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TSC_SuplaLocation) - SUPLA_LOCATION_CAPTION_MAXSIZE) &&
-            srpc->sdp.data_size <= sizeof(TSC_SuplaLocation)) {
-          rd->data.sc_location =
-              (TSC_SuplaLocation *)malloc(sizeof(TSC_SuplaLocation));
-        }
+  return SUPLA_RESULT_TRUE;
+}
 
-        break;
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_reserve(void *_srpc,
+                                                unsigned _supla_int_t call_type,
+                                                unsigned _supla_int_t data_size,
+                                                char **data) {
+  return srpc_out_reserve_ex(_srpc, call_type, SRPC_LANE_DEFAULT, data_size,
+                             data);
+}
 
-      case SUPLA_SC_CALL_LOCATIONPACK_UPDATE:
-        srpc_getlocationpack(srpc, rd);
-        break;
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_commit(void *_srpc) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  return lck_unlock_r(srpc->out_lck, srpc_out__commit(srpc, NULL));
+}
 
-      case SUPLA_SC_CALL_CHANNEL_UPDATE:
+void SRPC_ICACHE_FLASH srpc_out_cancel(void *_srpc) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  srpc->out_sdp = NULL;
+  lck_unlock(srpc->out_lck);
+}
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TSC_SuplaChannel) - SUPLA_CHANNEL_CAPTION_MAXSIZE) &&
-            srpc->sdp.data_size <= sizeof(TSC_SuplaChannel)) {
-          rd->data.sc_channel =
-              (TSC_SuplaChannel *)malloc(sizeof(TSC_SuplaChannel));
-        }
+unsigned _supla_int_t SRPC_ICACHE_FLASH srpc_out_pending_bytes(void *_srpc) {
+  unsigned _supla_int_t result;
 
-        break;
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  lck_lock(srpc->out_lck);
+  // Queued packets get their trailing tag in the out buffer
+  result = sproto_out_data_size(srpc->proto) + srpc->out_queue.data_size +
+           srpc->out_queue.item_count * SUPLA_TAG_SIZE;
+  lck_unlock(srpc->out_lck);
 
-      case SUPLA_SC_CALL_CHANNEL_UPDATE_B:
+  return result;
+}
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TSC_SuplaChannel_B) - SUPLA_CHANNEL_CAPTION_MAXSIZE) &&
-            srpc->sdp.data_size <= sizeof(TSC_SuplaChannel_B)) {
-          rd->data.sc_channel_b =
-              (TSC_SuplaChannel_B *)malloc(sizeof(TSC_SuplaChannel_B));
-        }
+unsigned _supla_int_t SRPC_ICACHE_FLASH srpc_out_queue_free(void *_srpc) {
+  unsigned _supla_int_t result;
 
-        break;
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  lck_lock(srpc->out_lck);
+  result = srpc->out_queue.size - srpc->out_queue.item_count;
+  lck_unlock(srpc->out_lck);
 
-      case SUPLA_SC_CALL_CHANNELPACK_UPDATE:
-        srpc_getchannelpack(srpc, rd);
-        break;
+  return result;
+}
 
-      case SUPLA_SC_CALL_CHANNELPACK_UPDATE_B:
-        srpc_getchannelpack_b(srpc, rd);
-        break;
+_supla_int_t SRPC_ICACHE_FLASH srpc_async__call(void *_srpc,
+                                                unsigned _supla_int_t call_type,
+                                                char *data,
+                                                unsigned _supla_int_t data_size,
+                                                unsigned char *version) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  char *out_data;
+  _supla_int_t result = srpc_async_call_begin(srpc, call_type);
 
-      case SUPLA_SC_CALL_CHANNEL_VALUE_UPDATE:
+  if (result != SUPLA_RESULT_TRUE) {
+    return result;
+  }
 
-        if (srpc->sdp.data_size == sizeof(TSC_SuplaChannelValue))
-          rd->data.sc_channel_value =
-              (TSC_SuplaChannelValue *)malloc(sizeof(TSC_SuplaChannelValue));
+  lck_lock(srpc->out_lck);
 
-        break;
+  if ((out_data = srpc_out__reserve(srpc, call_type, SRPC_LANE_DEFAULT,
+                                    data_size)) == NULL) {
+    return lck_unlock_r(srpc->out_lck, SUPLA_RESULT_FALSE);
+  }
 
-      case SUPLA_SC_CALL_CHANNELGROUP_PACK_UPDATE:
-        srpc_getchannelgroup_pack(srpc, rd);
-        break;
+  if (data_size > 0) memcpy(out_data, data, data_size);
 
-      case SUPLA_SC_CALL_CHANNELGROUP_RELATION_PACK_UPDATE:
-        if (srpc->sdp.data_size <= sizeof(TSC_SuplaChannelGroupRelationPack) &&
-            srpc->sdp.data_size >=
-                (sizeof(TSC_SuplaChannelGroupRelationPack) -
-                 (sizeof(TSC_SuplaChannelGroupRelation) *
-                  SUPLA_CHANNELGROUP_RELATION_PACK_MAXCOUNT))) {
-          rd->data.sc_channelgroup_relation_pack =
-              (TSC_SuplaChannelGroupRelationPack *)malloc(
-                  sizeof(TSC_SuplaChannelGroupRelationPack));
-        }
-        break;
+  return lck_unlock_r(srpc->out_lck, srpc_out__commit(srpc, version));
+}
 
-      case SUPLA_SC_CALL_CHANNELVALUE_PACK_UPDATE:
-        if (srpc->sdp.data_size <= sizeof(TSC_SuplaChannelValuePack) &&
-            srpc->sdp.data_size >= (sizeof(TSC_SuplaChannelValuePack) -
-                                    (sizeof(TSC_SuplaChannelValue) *
-                                     SUPLA_CHANNELVALUE_PACK_MAXCOUNT))) {
-          rd->data.sc_channelvalue_pack = (TSC_SuplaChannelValuePack *)malloc(
-              sizeof(TSC_SuplaChannelValuePack));
-        }
-        break;
+_supla_int_t SRPC_ICACHE_FLASH
+srpc_async_call(void *_srpc, unsigned _supla_int_t call_type, char *data,
+                unsigned _supla_int_t data_size) {
+  return srpc_async__call(_srpc, call_type, data, data_size, NULL);
+}
 
-      case SUPLA_CS_CALL_CHANNEL_SET_VALUE:
+unsigned char SRPC_ICACHE_FLASH srpc_get_proto_version(void *_srpc) {
+  unsigned char version;
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaChannelNewValue))
-          rd->data.cs_channel_new_value = (TCS_SuplaChannelNewValue *)malloc(
-              sizeof(TCS_SuplaChannelNewValue));
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+  lck_lock(srpc->out_lck);
+  version = sproto_get_version(srpc->proto);
+  lck_unlock(srpc->out_lck);
 
-        break;
+  return version;
+}
 
-      case SUPLA_CS_CALL_SET_VALUE:
+void SRPC_ICACHE_FLASH srpc_set_proto_version(void *_srpc,
+                                              unsigned char version) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaNewValue))
-          rd->data.cs_new_value = (TCS_SuplaNewValue *)malloc(
-              sizeof(TCS_SuplaNewValue));
+  lck_lock(srpc->in_lck);
+  lck_lock(srpc->out_lck);
+  sproto_set_version(srpc->proto, version);
+  lck_unlock(srpc->out_lck);
+  lck_unlock(srpc->in_lck);
+}
 
-        break;
+void SRPC_ICACHE_FLASH srpc_get_lock_stats(void *_srpc, TLckStats *in_stats,
+                                           TLckStats *out_stats) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
 
-      case SUPLA_CS_CALL_CHANNEL_SET_VALUE_B:
+  if (in_stats != NULL) lck_get_stats(srpc->in_lck, in_stats);
+  if (out_stats != NULL) lck_get_stats(srpc->out_lck, out_stats);
+}
 
-        if (srpc->sdp.data_size == sizeof(TCS_SuplaChannelNewValue_B))
-          rd->data.cs_channel_new_value_b =
-              (TCS_SuplaChannelNewValue_B *)malloc(
-                  sizeof(TCS_SuplaChannelNewValue_B));
+void SRPC_ICACHE_FLASH srpc_get_proto_stats(void *_srpc,
+                                            TSuplaProtoStats *stats) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
 
-        break;
+  lck_lock(srpc->in_lck);
+  lck_lock(srpc->out_lck);
+  sproto_get_stats(srpc->proto, stats);
+  lck_unlock(srpc->out_lck);
+  lck_unlock(srpc->in_lck);
+}
+
+#ifdef SRPC_STATS
+static unsigned long long srpc_stats_time_us(void) {
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000ULL +
+         (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000ULL /
+             freq.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+#endif /*_WIN32*/
+}
 
-      case SUPLA_SC_CALL_EVENT:
+static char srpc_stats_init(Tsrpc *srpc) {
+  unsigned _supla_int_t a;
 
-        if (srpc->sdp.data_size >=
-                (sizeof(TSC_SuplaEvent) - SUPLA_SENDER_NAME_MAXSIZE) &&
-            srpc->sdp.data_size <= sizeof(TSC_SuplaEvent)) {
-          rd->data.sc_event = (TSC_SuplaEvent *)malloc(sizeof(TSC_SuplaEvent));
-        }
+  srpc->stats = (TsrpcCallStats *)malloc(sizeof(TsrpcCallStats) *
+                                         (SRPC_CALL_TYPE_COUNT + 1));
 
-        break;
+  if (srpc->stats == NULL) {
+    return SUPLA_RESULT_FALSE;
+  }
 
-      case SUPLA_CS_CALL_GET_OAUTH_PARAMETERS:
+  memset(srpc->stats, 0, sizeof(TsrpcCallStats) * (SRPC_CALL_TYPE_COUNT + 1));
 
-        if (srpc->sdp.data_size == sizeof(TCS_OAuthParametersRequest))
-          rd->data.cs_oauth_parameters_request =
-              (TCS_OAuthParametersRequest *)malloc(
-                  sizeof(TCS_OAuthParametersRequest));
+  for (a = 0; a < SRPC_CALL_TYPE_COUNT; a++) {
+    srpc->stats[a].call_type = srpc_call_types[a].call_type;
+  }
 
-        break;
+  return SUPLA_RESULT_TRUE;
+}
 
-      case SUPLA_SC_CALL_GET_OAUTH_PARAMETERS_RESULT:
+// Entry of the call type, the last one if it isn't in the table
+static unsigned _supla_int_t srpc_stats_idx(unsigned _supla_int_t call_type) {
+  Tsrpc_CallType ct;
+  _supla_int_t idx = srpc_call_type_find(call_type, &ct);
 
-        if (srpc->sdp.data_size == sizeof(TSC_OAuthParameters))
-          rd->data.sc_oauth_parameters =
-              (TSC_OAuthParameters *)malloc(sizeof(TSC_OAuthParameters));
+  return idx >= 0 ? (unsigned _supla_int_t)idx : SRPC_CALL_TYPE_COUNT;
+}
 
-        break;
-#endif /*#ifndef SRPC_EXCLUDE_CLIENT*/
-    }
+// Bytes of a whole frame on the wire, both tags included
+static unsigned _supla_int_t srpc_stats_frame_size(
+    unsigned _supla_int_t data_size) {
+  return sizeof(TSuplaDataPacket) - SUPLA_MAX_DATA_SIZE + data_size +
+         SUPLA_TAG_SIZE;
+}
 
-    if (call_with_no_data == 1) {
-      return lck_unlock_r(srpc->lck, SUPLA_RESULT_TRUE);
-    }
+static void srpc_stats_in(Tsrpc *srpc, TSuplaDataPacketView *view) {
+  TsrpcCallStats *stats = &srpc->stats[srpc_stats_idx(view->call_type)];
 
-    if (rd->data.dcs_ping != NULL) {
-      if (srpc->sdp.data_size > 0)
-        memcpy(rd->data.dcs_ping, srpc->sdp.data, srpc->sdp.data_size);
+  stats->frames_in++;
+  stats->bytes_in += srpc_stats_frame_size(view->data_size);
+}
 
-      return lck_unlock_r(srpc->lck, SUPLA_RESULT_TRUE);
-    }
+static void srpc_stats_error(Tsrpc *srpc, unsigned _supla_int_t call_type,
+                             char result) {
+  signed char code = (signed char)result;
 
-    return lck_unlock_r(srpc->lck, SUPLA_RESULT_DATA_ERROR);
+  if (code < 0 && SRPC_STATS_ERROR_IDX(code) < SRPC_STATS_ERROR_COUNT) {
+    srpc->stats[srpc_stats_idx(call_type)]
+        .errors[SRPC_STATS_ERROR_IDX(code)]++;
   }
+}
 
-  return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
+// A frame committed at commit_time_us has been appended to the out buffer
+static void srpc_stats_out(Tsrpc *srpc, TSuplaDataPacket *sdp,
+                           unsigned long long commit_time_us) {
+  unsigned _supla_int_t idx = srpc_stats_idx(sdp->call_type);
+  unsigned _supla_int_t size = srpc_stats_frame_size(sdp->data_size);
+  Tsrpc_StatsMark *mark;
+
+  srpc->stats[idx].frames_out++;
+  srpc->stats[idx].bytes_out += size;
+  srpc->out_appended += size;
+
+  // With all marks taken the frame goes unsampled
+  if (srpc->mark_count < SRPC_STATS_MARK_COUNT) {
+    mark = &srpc->mark[(srpc->mark_head + srpc->mark_count) %
+                       SRPC_STATS_MARK_COUNT];
+    mark->end = srpc->out_appended;
+    mark->stats_idx = idx;
+    mark->commit_time_us = commit_time_us;
+    srpc->mark_count++;
+  }
 }
 
-void SRPC_ICACHE_FLASH srpc_rd_free(TsrpcReceivedData *rd) {
-  if (rd->call_type > 0) {
-    // first one
+static void srpc_stats_commit(Tsrpc *srpc, TSuplaDataPacket *sdp) {
+  unsigned long long now = srpc_stats_time_us();
 
-    if (rd->data.dcs_ping != NULL) free(rd->data.dcs_ping);
+  if (srpc->out_sdp_queued) {
+    // The slot about to be committed
+    srpc->out_queue.slot[srpc->out_queue.free_head - 1].commit_time_us = now;
+  } else {
+    srpc_stats_out(srpc, sdp, now);
+  }
+}
 
-    rd->call_type = 0;
+// The first packet of the out queue has been appended to the out buffer
+static void srpc_stats_dequeue(Tsrpc *srpc) {
+  unsigned _supla_int_t idx;
+
+  if (srpc_queue_first(&srpc->out_queue, &idx) == SUPLA_RESULT_TRUE) {
+    srpc_stats_out(srpc, srpc->out_queue.slot[idx].sdp,
+                   srpc->out_queue.slot[idx].commit_time_us);
   }
 }
 
-unsigned char SRPC_ICACHE_FLASH
-srpc_call_min_version_required(void *_srpc, unsigned _supla_int_t call_type) {
-  switch (call_type) {
-    case SUPLA_DCS_CALL_GETVERSION:
-    case SUPLA_SDC_CALL_GETVERSION_RESULT:
-    case SUPLA_SDC_CALL_VERSIONERROR:
-    case SUPLA_DCS_CALL_PING_SERVER:
-    case SUPLA_SDC_CALL_PING_SERVER_RESULT:
-    case SUPLA_DS_CALL_REGISTER_DEVICE:
-    case SUPLA_SD_CALL_REGISTER_DEVICE_RESULT:
-    case SUPLA_CS_CALL_REGISTER_CLIENT:
-    case SUPLA_SC_CALL_REGISTER_CLIENT_RESULT:
-    case SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED:
-    case SUPLA_SD_CALL_CHANNEL_SET_VALUE:
-    case SUPLA_DS_CALL_CHANNEL_SET_VALUE_RESULT:
-    case SUPLA_SC_CALL_LOCATION_UPDATE:
-    case SUPLA_SC_CALL_LOCATIONPACK_UPDATE:
-    case SUPLA_SC_CALL_CHANNEL_UPDATE:
-    case SUPLA_SC_CALL_CHANNELPACK_UPDATE:
-    case SUPLA_SC_CALL_CHANNEL_VALUE_UPDATE:
-    case SUPLA_CS_CALL_GET_NEXT:
-    case SUPLA_SC_CALL_EVENT:
-    case SUPLA_CS_CALL_CHANNEL_SET_VALUE:
-      return 1;
+static void srpc_stats_written(Tsrpc *srpc, unsigned _supla_int_t size) {
+  unsigned long long now, latency_ms;
+  unsigned char bucket;
+  Tsrpc_StatsMark *mark;
 
-    case SUPLA_DS_CALL_REGISTER_DEVICE_B:
-    case SUPLA_DCS_CALL_SET_ACTIVITY_TIMEOUT:
-    case SUPLA_SDC_CALL_SET_ACTIVITY_TIMEOUT_RESULT:
-      return 2;
+  srpc->out_written += size;
 
-    case SUPLA_CS_CALL_CHANNEL_SET_VALUE_B:
-      return 3;
+  if (srpc->mark_count == 0) {
+    return;
+  }
 
-    case SUPLA_DS_CALL_GET_FIRMWARE_UPDATE_URL:
-    case SUPLA_SD_CALL_GET_FIRMWARE_UPDATE_URL_RESULT:
-      return 5;
+  now = srpc_stats_time_us();
 
-    case SUPLA_DS_CALL_REGISTER_DEVICE_C:
-    case SUPLA_CS_CALL_REGISTER_CLIENT_B:
-      return 6;
+  while (srpc->mark_count > 0) {
+    mark = &srpc->mark[srpc->mark_head];
+
+    // The offsets wrap around, so they are compared by their difference
+    if ((_supla_int_t)(srpc->out_written - mark->end) < 0) {
+      break;
+    }
 
-    case SUPLA_CS_CALL_REGISTER_CLIENT_C:
-    case SUPLA_DS_CALL_REGISTER_DEVICE_D:
-    case SUPLA_DCS_CALL_GET_REGISTRATION_ENABLED:
-    case SUPLA_SDC_CALL_GET_REGISTRATION_ENABLED_RESULT:
-    case SUPLA_CS_CALL_GET_OAUTH_PARAMETERS:
-    case SUPLA_SC_CALL_GET_OAUTH_PARAMETERS_RESULT:
-      return 7;
+    latency_ms = (now - mark->commit_time_us) / 1000;
 
-    case SUPLA_SC_CALL_CHANNELPACK_UPDATE_B:
-    case SUPLA_SC_CALL_CHANNEL_UPDATE_B:
-      return 8;
+    for (bucket = 0; bucket < SRPC_STATS_LATENCY_BUCKETS - 1 &&
+                     latency_ms >= (1ULL << (2 * bucket));
+         bucket++) {
+    }
 
-    case SUPLA_SC_CALL_REGISTER_CLIENT_RESULT_B:
-    case SUPLA_SC_CALL_CHANNELGROUP_PACK_UPDATE:
-    case SUPLA_SC_CALL_CHANNELGROUP_RELATION_PACK_UPDATE:
-    case SUPLA_SC_CALL_CHANNELVALUE_PACK_UPDATE:
-    case SUPLA_CS_CALL_SET_VALUE:
-      return 9;
+    srpc->stats[mark->stats_idx].latency[bucket]++;
+    srpc->mark_head = (srpc->mark_head + 1) % SRPC_STATS_MARK_COUNT;
+    srpc->mark_count--;
   }
+}
 
-  return 255;
+static void srpc_stats_refused(Tsrpc *srpc, unsigned _supla_int_t call_type,
+                               unsigned char dropped) {
+  TsrpcCallStats *stats = &srpc->stats[srpc_stats_idx(call_type)];
+
+  if (dropped) {
+    stats->dropped++;
+  } else {
+    stats->queue_full++;
+  }
 }
 
-unsigned char SRPC_ICACHE_FLASH
-srpc_call_allowed(void *_srpc, unsigned _supla_int_t call_type) {
-  unsigned char min_ver = srpc_call_min_version_required(_srpc, call_type);
+static char srpc_stats_active(TsrpcCallStats *stats) {
+  unsigned char a;
 
-  if (min_ver == 0 || srpc_get_proto_version(_srpc) >= min_ver) {
+  if (stats->frames_in || stats->frames_out || stats->queue_full ||
+      stats->dropped) {
     return 1;
   }
 
+  for (a = 0; a < SRPC_STATS_ERROR_COUNT; a++) {
+    if (stats->errors[a]) {
+      return 1;
+    }
+  }
+
   return 0;
 }
+#endif /*SRPC_STATS*/
 
-_supla_int_t SRPC_ICACHE_FLASH srpc_async__call(void *_srpc,
-                                                unsigned _supla_int_t call_type,
-                                                char *data,
-                                                unsigned _supla_int_t data_size,
-                                                unsigned char *version) {
+unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_get_call_stats(void *_srpc, TsrpcCallStats *stats,
+                    unsigned _supla_int_t max_count) {
+  unsigned _supla_int_t result = 0;
+#ifdef SRPC_STATS
+  unsigned _supla_int_t a;
   Tsrpc *srpc = (Tsrpc *)_srpc;
 
-  if (!srpc_call_allowed(_srpc, call_type)) {
-    if (srpc->params.on_min_version_required != NULL) {
-      srpc->params.on_min_version_required(
-          _srpc, call_type, srpc_call_min_version_required(_srpc, call_type),
-          srpc->params.user_params);
+  lck_lock(srpc->in_lck);
+  lck_lock(srpc->out_lck);
+
+  for (a = 0; a <= SRPC_CALL_TYPE_COUNT; a++) {
+    if (!srpc_stats_active(&srpc->stats[a])) {
+      continue;
     }
 
-    return SUPLA_RESULT_CALL_NOT_ALLOWED;
-  }
+    if (stats != NULL) {
+      if (result >= max_count) {
+        break;
+      }
 
-  if (srpc->params.before_async_call != NULL) {
-    srpc->params.before_async_call(_srpc, call_type, srpc->params.user_params);
-  }
+      memcpy(&stats[result], &srpc->stats[a], sizeof(TsrpcCallStats));
+    }
 
-  lck_lock(srpc->lck);
+    result++;
+  }
 
-  sproto_sdp_init(srpc->proto, &srpc->sdp);
+  lck_unlock(srpc->out_lck);
+  lck_unlock(srpc->in_lck);
+#endif /*SRPC_STATS*/
 
-  if (version != NULL) srpc->sdp.version = *version;
+  return result;
+}
 
-  if (SUPLA_RESULT_TRUE ==
-          sproto_set_data(&srpc->sdp, data, data_size, call_type) &&
-      srpc_out_queue_push(srpc, &srpc->sdp)) {
-#ifndef __EH_DISABLED
-    if (srpc->params.eh != 0) {
-      eh_raise_event(srpc->params.eh);
-    }
-#endif
+void SRPC_ICACHE_FLASH srpc_log_summary(void *_srpc) {
+  Tsrpc *srpc = (Tsrpc *)_srpc;
+#ifdef SRPC_STATS
+  TsrpcCallStats *stats, *s;
+  unsigned _supla_int_t count, a;
+#endif /*SRPC_STATS*/
 
-    return lck_unlock_r(srpc->lck, srpc->sdp.rr_id);
+  if (srpc == NULL) {
+    supla_log(LOG_DEBUG, "SRPC - Not initialized!");
+    return;
   }
 
-  return lck_unlock_r(srpc->lck, SUPLA_RESULT_FALSE);
-}
-
-_supla_int_t SRPC_ICACHE_FLASH
-srpc_async_call(void *_srpc, unsigned _supla_int_t call_type, char *data,
-                unsigned _supla_int_t data_size) {
-  return srpc_async__call(_srpc, call_type, data, data_size, NULL);
-}
+  lck_lock(srpc->in_lck);
+  lck_lock(srpc->out_lck);
+  sproto_log_summary(srpc->proto);
+  lck_unlock(srpc->out_lck);
+  lck_unlock(srpc->in_lck);
 
-unsigned char SRPC_ICACHE_FLASH srpc_get_proto_version(void *_srpc) {
-  unsigned char version;
+#ifdef SRPC_STATS
+  stats = (TsrpcCallStats *)malloc(sizeof(TsrpcCallStats) *
+                                   (SRPC_CALL_TYPE_COUNT + 1));
 
-  Tsrpc *srpc = (Tsrpc *)_srpc;
-  lck_lock(srpc->lck);
-  version = sproto_get_version(srpc->proto);
-  lck_unlock(srpc->lck);
+  if (stats == NULL) {
+    return;
+  }
 
-  return version;
-}
+  count = srpc_get_call_stats(srpc, stats, SRPC_CALL_TYPE_COUNT + 1);
 
-void SRPC_ICACHE_FLASH srpc_set_proto_version(void *_srpc,
-                                              unsigned char version) {
-  Tsrpc *srpc = (Tsrpc *)_srpc;
+  for (a = 0; a < count; a++) {
+    s = &stats[a];
+
+    supla_log(LOG_DEBUG, "CALL %i", s->call_type);
+    supla_log(LOG_DEBUG, "           in: %u frames, %llu bytes", s->frames_in,
+              s->bytes_in);
+    supla_log(LOG_DEBUG, "          out: %u frames, %llu bytes", s->frames_out,
+              s->bytes_out);
+    supla_log(LOG_DEBUG, "   queue full: %u, dropped: %u", s->queue_full,
+              s->dropped);
+    supla_log(LOG_DEBUG, "       errors: %u %u %u %u %u", s->errors[0],
+              s->errors[1], s->errors[2], s->errors[3], s->errors[4]);
+    supla_log(LOG_DEBUG, "      latency: %u %u %u %u %u %u %u %u",
+              s->latency[0], s->latency[1], s->latency[2], s->latency[3],
+              s->latency[4], s->latency[5], s->latency[6], s->latency[7]);
+  }
 
-  lck_lock(srpc->lck);
-  sproto_set_version(srpc->proto, version);
-  lck_unlock(srpc->lck);
+  free(stats);
+#else
+  supla_log(LOG_DEBUG, "SRPC - Built without SRPC_STATS");
+#endif /*SRPC_STATS*/
 }
 
 _supla_int_t SRPC_ICACHE_FLASH srpc_dcs_async_getversion(void *_srpc) {
@@ -1204,12 +2303,26 @@ _supla_int_t SRPC_ICACHE_FLASH srpc_sd_async_get_firmware_update_url_result(
 
 _supla_int_t SRPC_ICACHE_FLASH srpc_ds_async_channel_value_changed(
     void *_srpc, unsigned char channel_number, char *value) {
-  TDS_SuplaDeviceChannelValue ncsc;
-  ncsc.ChannelNumber = channel_number;
-  memcpy(ncsc.value, value, SUPLA_CHANNELVALUE_SIZE);
+  return srpc_ds_async_channel_value_changed_ex(_srpc, channel_number, value,
+                                                SRPC_LANE_DEFAULT);
+}
+
+_supla_int_t SRPC_ICACHE_FLASH srpc_ds_async_channel_value_changed_ex(
+    void *_srpc, unsigned char channel_number, char *value,
+    unsigned char lane) {
+  TDS_SuplaDeviceChannelValue *ncsc;
+  _supla_int_t result = srpc_out_reserve_ex(
+      _srpc, SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED, lane,
+      sizeof(TDS_SuplaDeviceChannelValue), (char **)&ncsc);
+
+  if (result != SUPLA_RESULT_TRUE) {
+    return result;
+  }
 
-  return srpc_async_call(_srpc, SUPLA_DS_CALL_DEVICE_CHANNEL_VALUE_CHANGED,
-                         (char *)&ncsc, sizeof(TDS_SuplaDeviceChannelValue));
+  ncsc->ChannelNumber = channel_number;
+  memcpy(ncsc->value, value, SUPLA_CHANNELVALUE_SIZE);
+
+  return srpc_out_commit(_srpc);
 }
 
 #endif /*SRPC_EXCLUDE_DEVICE*/
@@ -1261,6 +2374,8 @@ srpc_sc_async_location_update(void *_srpc, TSC_SuplaLocation *location) {
                          size);
 }
 
+// Two passes: the first sums the compacted item sizes, the second writes the
+// items straight into the reserved packet, so no intermediate buffer is needed.
 _supla_int_t SRPC_ICACHE_FLASH srpc_set_pack(
     void *_srpc, void *pack, _supla_int_t count,
     _func_srpc_pack_get_caption_size get_caption_size,
@@ -1269,47 +2384,48 @@ _supla_int_t SRPC_ICACHE_FLASH srpc_set_pack(
     unsigned _supla_int_t pack_sizeof, unsigned _supla_int_t pack_max_count,
     unsigned _supla_int_t caption_max_size, unsigned _supla_int_t item_sizeof,
     unsigned _supla_int_t call_type) {
-  _supla_int_t result = 0;
+  char *data;
+  _supla_int_t result;
   _supla_int_t a;
   _supla_int_t n = 0;
-  _supla_int_t size = 0;
-  _supla_int_t offset = 0;
+  unsigned _supla_int_t caption_size;
+  unsigned _supla_int_t item_size;
+  unsigned _supla_int_t size;
+  unsigned _supla_int_t offset;
 
   if (count > pack_max_count) return 0;
 
-  size = pack_sizeof - (item_sizeof * pack_max_count);
-  offset = size;
-
-  char *buffer = malloc(size);
-
-  if (buffer == NULL) return 0;
-
-  memcpy(buffer, pack, size);
+  offset = pack_sizeof - (item_sizeof * pack_max_count);
+  size = offset;
 
   for (a = 0; a < count; a++) {
-    if (get_caption_size(pack, a) <= caption_max_size) {
-      size += item_sizeof - caption_max_size + get_caption_size(pack, a);
+    caption_size = get_caption_size(pack, a);
+    if (caption_size <= caption_max_size) {
+      size += item_sizeof - caption_max_size + caption_size;
+    }
+  }
 
-      char *new_buffer = (char *)realloc(buffer, size);
+  result = srpc_out_reserve(_srpc, call_type, size, &data);
 
-      if (new_buffer == NULL) {
-        free(buffer);
-        return 0;
-      }
+  if (result != SUPLA_RESULT_TRUE) {
+    return result;
+  }
 
-      buffer = new_buffer;
-      memcpy(&buffer[offset], get_item_ptr(pack, a), size - offset);
-      offset += size - offset;
+  memcpy(data, pack, offset);
+
+  for (a = 0; a < count; a++) {
+    caption_size = get_caption_size(pack, a);
+    if (caption_size <= caption_max_size) {
+      item_size = item_sizeof - caption_max_size + caption_size;
+      memcpy(&data[offset], get_item_ptr(pack, a), item_size);
+      offset += item_size;
       n++;
     }
   }
 
-  set_pack_count(buffer, n, 0);
+  set_pack_count(data, n, 0);
 
-  result = srpc_async_call(_srpc, call_type, buffer, size);
-
-  free(buffer);
-  return result;
+  return srpc_out_commit(_srpc);
 }
 
 unsigned _supla_int_t srpc_locationpack_get_caption_size(void *pack,
@@ -21,6 +21,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include "eh.h"
+#include "lck.h"
 #include "proto.h"
 
 #ifdef __ANDROID__
@@ -40,12 +41,35 @@
 #define SRPC_EXCLUDE_CLIENT
 #endif /*__AVR__*/
 
+// Lanes of the out queue, drained in this order. A call that finds the queue
+// full takes the place of the oldest one queued in a less urgent lane.
+#define SRPC_LANE_CONTROL 0  // keepalive, registration and versions
+#define SRPC_LANE_STATE 1    // actuator state changes and everything else
+#define SRPC_LANE_DATA 2     // periodic measurements
+#define SRPC_LANE_COUNT 3
+#define SRPC_LANE_DEFAULT 0xFF  // the lane of the call type
+
+// Per call type traffic counters, see srpc_get_call_stats. Left out of the
+// microcontroller builds for the RAM they take.
+#if !defined(ESP8266) && !defined(__AVR__) && !defined(SRPC_WITHOUT_STATS)
+#define SRPC_STATS
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef _supla_int_t (*_func_srpc_DataRW)(void *buf, _supla_int_t count,
                                           void *user_params);
+
+typedef struct {
+  void *data;
+  _supla_int_t size;
+} TsrpcIoVec;
+
+typedef _supla_int_t (*_func_srpc_DataWriteV)(const TsrpcIoVec *iov,
+                                              int iov_count,
+                                              void *user_params);
 typedef void (*_func_srpc_event_OnRemoteCallReceived)(
     void *_srpc, unsigned _supla_int_t rr_id, unsigned _supla_int_t call_type,
     void *user_params, unsigned char proto_version);
@@ -58,16 +82,61 @@ typedef void (*_func_srpc_event_OnVersionError)(void *_srpc,
 typedef void (*_func_srpc_event_OnMinVersionRequired)(
     void *_srpc, unsigned _supla_int_t call_type, unsigned char min_version,
     void *user_params);
+typedef void (*_func_srpc_event_OnOutWritable)(void *_srpc, void *user_params);
+typedef void (*_func_srpc_event_OnOutDropped)(void *_srpc,
+                                              TSuplaDataPacket *sdp,
+                                              unsigned char lane,
+                                              void *user_params);
+typedef void (*_func_srpc_event_OnWorkPending)(void *_srpc, void *user_params);
 
 typedef struct {
   _func_srpc_DataRW data_read;
   _func_srpc_DataRW data_write;
+  // Optional scatter/gather replacement of data_write, returning the number
+  // of bytes written as well. In the ring mode the parts point straight into
+  // the out ring, the wrapped around one included.
+  _func_srpc_DataWriteV data_writev;
   _func_srpc_event_OnRemoteCallReceived on_remote_call_received;
   _func_srpc_event_OnVersionError on_version_error;
   _func_srpc_event_BeforeCall before_async_call;
   _func_srpc_event_OnMinVersionRequired on_min_version_required;
+  // Called from srpc_iterate once the out queue has room again after an
+  // outgoing call was refused for lack of it
+  _func_srpc_event_OnOutWritable on_out_writable;
+  // Called when a queued call of a less urgent lane is dropped to make room
+  // for a more urgent one, so its owner can send it again. sdp is valid only
+  // for the duration of the call, which comes from inside another outgoing
+  // call: no srpc function may be called from it.
+  _func_srpc_event_OnOutDropped on_out_dropped;
 
+  // Optional. Raised when an outgoing call is queued and whenever
+  // srpc_iterate leaves work for the next round, so a loop blocked in
+  // eh_wait wakes up only when there is something to do.
   TEventHandler *eh;
+  // Called wherever eh is raised, with the srpc locks held, so a caller
+  // driving many sessions can tell which of them need srpc_iterate. It must
+  // not call srpc functions.
+  _func_srpc_event_OnWorkPending on_work_pending;
+
+  // 0 - stream buffers grow and shrink on demand, otherwise the capacity of
+  // each of the two fixed ring buffers allocated by srpc_init, at least
+  // SPROTO_RING_MIN_SIZE or srpc_init fails
+  unsigned _supla_int_t ring_buffer_size;
+
+  // Skip corrupted input up to the next tag instead of failing the iteration
+  unsigned char resync;
+
+  // Capacity of each of the in and out packet queues, 0 - SRPC_QUEUE_SIZE
+  unsigned _supla_int_t queue_size;
+
+  // Largest single data_read/data_write, 0 - SRPC_BUFFER_SIZE. The buffer is
+  // allocated once by srpc_init, and not at all in the ring mode, where reads
+  // and writes go straight to and from the rings.
+  unsigned _supla_int_t io_buffer_size;
+
+  // LCK_POLICY_* of the in and out locks. Only LCK_POLICY_RECURSIVE allows
+  // calling srpc functions between srpc_out_reserve and srpc_out_commit.
+  unsigned char lock_policy;
 
   void *user_params;
 } TsrpcParams;
@@ -113,35 +182,170 @@ union TsrpcDataPacketData {
   TCS_SuplaNewValue *cs_new_value;
 };
 
+// Small device side payloads decoded without touching the heap
+union TsrpcReceivedDataInline {
+  TSDC_SuplaPingServerResult sdc_ping_result;
+  TSDC_SuplaGetVersionResult sdc_getversion_result;
+  TSDC_SuplaVersionError sdc_version_error;
+  TSDC_SuplaSetActivityTimeoutResult sdc_set_activity_timeout_result;
+  TSD_SuplaRegisterDeviceResult sd_register_device_result;
+  TSD_SuplaChannelNewValue sd_channel_new_value;
+  TSDC_RegistrationEnabled sdc_reg_enabled;
+  void *align;
+};
+
+#define SRPC_RD_STORAGE_HEAP 0
+#define SRPC_RD_STORAGE_BORROWED 1  // points into the in buffer
+#define SRPC_RD_STORAGE_INLINE 2    // points to inline_data
+#define SRPC_RD_STORAGE_ARENA 3     // points to the srpc_getdata_ex arena
+
 typedef struct {
   unsigned _supla_int_t call_type;
   unsigned _supla_int_t rr_id;
+  unsigned char storage;
 
   union TsrpcDataPacketData data;
+  // data may point here, so the struct must not be copied before srpc_rd_free
+  union TsrpcReceivedDataInline inline_data;
 } TsrpcReceivedData;
 
 void SRPC_ICACHE_FLASH srpc_params_init(TsrpcParams *params);
 
 void *SRPC_ICACHE_FLASH srpc_init(TsrpcParams *params);
 void SRPC_ICACHE_FLASH srpc_free(void *_srpc);
+void *SRPC_ICACHE_FLASH srpc_get_user_params(void *_srpc);
 
 char SRPC_ICACHE_FLASH srpc_input_dataexists(void *_srpc);
 
 char SRPC_ICACHE_FLASH srpc_iterate(void *_srpc);
+// Dispatches up to max_count complete incoming packets and moves up to
+// max_count queued packets to the out buffer before a single data_write.
+// 0 - no limit. srpc_iterate is the same with max_count = 1.
+char SRPC_ICACHE_FLASH srpc_iterate_batch(void *_srpc,
+                                          unsigned _supla_int_t max_count);
 
 char SRPC_ICACHE_FLASH srpc_getdata(void *_srpc, TsrpcReceivedData *rd,
                                     unsigned _supla_int_t rr_id);
+
+// Payloads too large for rd->inline_data go to the arena when they fit in
+// arena_size bytes, to the heap otherwise
+char SRPC_ICACHE_FLASH srpc_getdata_ex(void *_srpc, TsrpcReceivedData *rd,
+                                       unsigned _supla_int_t rr_id, void *arena,
+                                       unsigned _supla_int_t arena_size);
+// Borrowed access to the packet being dispatched by on_remote_call_received.
+// Nothing is copied and the data stays valid until the callback returns.
+// Outside of the callback, or once the packet was taken, SUPLA_RESULT_FALSE is
+// returned and srpc_getdata has to be used instead.
+char SRPC_ICACHE_FLASH srpc_getview(void *_srpc, TSuplaDataPacketView *view,
+                                    unsigned _supla_int_t rr_id);
+// Same as srpc_getdata, but a fixed size payload of a borrowed packet is
+// decoded in place. srpc_rd_free is still required.
+char SRPC_ICACHE_FLASH srpc_getdata_borrowed(void *_srpc,
+                                             TsrpcReceivedData *rd,
+                                             unsigned _supla_int_t rr_id);
 void SRPC_ICACHE_FLASH srpc_rd_free(TsrpcReceivedData *rd);
 
+#ifndef SRPC_EXCLUDE_CLIENT
+// Item of a compact pack, pointing into the received packet. item may be cast
+// to the item struct of the pack, e.g. TSC_SuplaChannel_B, but only
+// caption_size bytes of its Caption are present.
+typedef struct {
+  const void *item;
+  const char *caption;
+  unsigned _supla_int_t caption_size;
+} TsrpcPackItem;
+
+typedef struct {
+  _supla_int_t count;
+  _supla_int_t total_left;
+
+  const char *data;
+  unsigned _supla_int_t data_size;
+  unsigned _supla_int_t offset;
+  _supla_int_t idx;
+  unsigned _supla_int_t item_header_size;
+  unsigned _supla_int_t caption_max_size;
+} TsrpcPackIterator;
+
+// Walks the items of a location, channel or channel group pack in place,
+// without expanding it to the full size pack struct like srpc_getdata does.
+// The view usually comes from srpc_getview and has to stay valid. The whole
+// pack is validated here, so srpc_pack_iterator_next can't fail halfway.
+char SRPC_ICACHE_FLASH srpc_pack_iterator_init(
+    TsrpcPackIterator *it, const TSuplaDataPacketView *view);
+char SRPC_ICACHE_FLASH srpc_pack_iterator_next(TsrpcPackIterator *it,
+                                               TsrpcPackItem *item);
+#endif /*SRPC_EXCLUDE_CLIENT*/
+
 unsigned char SRPC_ICACHE_FLASH srpc_get_proto_version(void *_srpc);
 void SRPC_ICACHE_FLASH srpc_set_proto_version(void *_srpc,
                                               unsigned char version);
+// Lock counters, all zero unless lck.c is built with LCK_STATS
+void SRPC_ICACHE_FLASH srpc_get_lock_stats(void *_srpc, TLckStats *in_stats,
+                                           TLckStats *out_stats);
+// Stream buffer counters, see TSuplaProtoStats
+void SRPC_ICACHE_FLASH srpc_get_proto_stats(void *_srpc,
+                                            TSuplaProtoStats *stats);
+
+// Buckets of the latency histogram, below 1, 4, 16 ... 4096 ms and the rest
+#define SRPC_STATS_LATENCY_BUCKETS 8
+// Errors by result code, SUPLA_RESULT_VERSION_ERROR (-1) first
+#define SRPC_STATS_ERROR_COUNT 5
+#define SRPC_STATS_ERROR_IDX(result) (-(result)-1)
+
+typedef struct {
+  // 0 - call types unknown to srpc and input too broken to tell the type
+  unsigned _supla_int_t call_type;
+
+  // Whole frames, header and tags included
+  unsigned int frames_in;
+  unsigned int frames_out;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+
+  unsigned int queue_full;  // calls refused for lack of room in the out queue
+  unsigned int dropped;     // queued calls evicted by more urgent ones
+  // Incoming frames that failed to parse or decode, by SRPC_STATS_ERROR_IDX
+  unsigned int errors[SRPC_STATS_ERROR_COUNT];
+
+  // Time from srpc_out_commit until data_write took the last byte of the
+  // frame. Only some of the frames are sampled when many are in flight.
+  unsigned int latency[SRPC_STATS_LATENCY_BUCKETS];
+} TsrpcCallStats;
+
+// Copies the counters of up to max_count call types seen so far, in call
+// type order with the unknown ones last, and returns the number copied.
+// With stats set to NULL it only counts them. Always 0 without SRPC_STATS.
+unsigned _supla_int_t SRPC_ICACHE_FLASH
+srpc_get_call_stats(void *_srpc, TsrpcCallStats *stats,
+                    unsigned _supla_int_t max_count);
+// sproto_log_summary of the stream buffers followed by the call counters
+void SRPC_ICACHE_FLASH srpc_log_summary(void *_srpc);
 
 unsigned char SRPC_ICACHE_FLASH
 srpc_call_min_version_required(void *_srpc, unsigned _supla_int_t call_type);
 unsigned char SRPC_ICACHE_FLASH
 srpc_call_allowed(void *_srpc, unsigned _supla_int_t call_type);
 
+// Outgoing call built in place. On SUPLA_RESULT_TRUE *data points to
+// data_size bytes of payload to be filled in and the srpc lock is held until
+// srpc_out_commit, which assigns and returns the rr_id, or srpc_out_cancel.
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_reserve(void *_srpc,
+                                                unsigned _supla_int_t call_type,
+                                                unsigned _supla_int_t data_size,
+                                                char **data);
+// srpc_out_reserve with an explicit SRPC_LANE_* instead of the call type's one
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_reserve_ex(
+    void *_srpc, unsigned _supla_int_t call_type, unsigned char lane,
+    unsigned _supla_int_t data_size, char **data);
+_supla_int_t SRPC_ICACHE_FLASH srpc_out_commit(void *_srpc);
+void SRPC_ICACHE_FLASH srpc_out_cancel(void *_srpc);
+
+// Bytes not yet handed to data_write, in the out buffer and the out queue
+unsigned _supla_int_t SRPC_ICACHE_FLASH srpc_out_pending_bytes(void *_srpc);
+// Out queue slots left before calls start to be refused
+unsigned _supla_int_t SRPC_ICACHE_FLASH srpc_out_queue_free(void *_srpc);
+
 // device/client <-> server
 _supla_int_t SRPC_ICACHE_FLASH srpc_dcs_async_getversion(void *_srpc);
 _supla_int_t SRPC_ICACHE_FLASH srpc_sdc_async_getversion_result(void *_srpc,
@@ -174,6 +378,9 @@ _supla_int_t SRPC_ICACHE_FLASH srpc_sd_async_registerdevice_result(
     void *_srpc, TSD_SuplaRegisterDeviceResult *registerdevice_result);
 _supla_int_t SRPC_ICACHE_FLASH srpc_ds_async_channel_value_changed(
     void *_srpc, unsigned char channel_number, char *value);
+_supla_int_t SRPC_ICACHE_FLASH srpc_ds_async_channel_value_changed_ex(
+    void *_srpc, unsigned char channel_number, char *value,
+    unsigned char lane);
 _supla_int_t SRPC_ICACHE_FLASH
 srpc_sd_async_set_channel_value(void *_srpc, TSD_SuplaChannelNewValue *value);
 _supla_int_t SRPC_ICACHE_FLASH
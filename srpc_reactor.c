@@ -0,0 +1,535 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "srpc_reactor.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+
+#define SRPC_REACTOR_MAX_EVENTS 64
+
+// Packets handled in each direction by one srpc_iterate_batch call. A busy
+// session goes back to the end of the ready list after every call.
+#define SRPC_REACTOR_BATCH 16
+
+typedef struct TsrpcReactorSession TsrpcReactorSession;
+typedef struct TsrpcReactorWatch TsrpcReactorWatch;
+
+typedef struct {
+  int epoll_fd;
+  _func_srpc_reactor_OnClose on_close;
+
+  unsigned int session_count;
+  TsrpcReactorSession *sessions;
+  TsrpcReactorWatch *watches;
+
+  // FIFO of the sessions that need srpc_iterate
+  TsrpcReactorSession *ready_head;
+  TsrpcReactorSession *ready_tail;
+} TsrpcReactor;
+
+// Sessions and watches share the epoll, the first member tells them apart
+struct TsrpcReactorSession {
+  unsigned char watch;  // 0
+  TsrpcReactor *reactor;
+  int fd;
+  void *srpc;
+  TsrpcParams params;  // callbacks and user_params of the caller
+
+  // Edge triggered epoll reports each change once, so the socket is
+  // considered ready until a read or write hits EAGAIN
+  unsigned char readable;
+  unsigned char writable;
+
+  unsigned char queued;  // on the ready list
+  unsigned char closing;
+
+  TsrpcReactorSession *prev;
+  TsrpcReactorSession *next;
+  TsrpcReactorSession *ready_next;
+};
+
+struct TsrpcReactorWatch {
+  unsigned char watch;  // 1
+  int fd;
+  _func_srpc_reactor_OnFdReady on_ready;
+  void *user_params;
+  TsrpcReactorWatch *next;
+};
+
+static void srpc_reactor_ready_push(TsrpcReactor *reactor,
+                                    TsrpcReactorSession *session) {
+  if (session->queued) {
+    return;
+  }
+
+  session->queued = 1;
+  session->ready_next = NULL;
+
+  if (reactor->ready_tail != NULL) {
+    reactor->ready_tail->ready_next = session;
+  } else {
+    reactor->ready_head = session;
+  }
+
+  reactor->ready_tail = session;
+}
+
+static TsrpcReactorSession *srpc_reactor_ready_pop(TsrpcReactor *reactor) {
+  TsrpcReactorSession *session = reactor->ready_head;
+
+  if (session != NULL) {
+    reactor->ready_head = session->ready_next;
+
+    if (reactor->ready_head == NULL) {
+      reactor->ready_tail = NULL;
+    }
+
+    session->queued = 0;
+  }
+
+  return session;
+}
+
+static _supla_int_t srpc_reactor_read(void *buf, _supla_int_t count,
+                                      void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  ssize_t result;
+
+  if (!session->readable) {
+    return -1;
+  }
+
+  result = read(session->fd, buf, count);
+
+  if (result > 0) {
+    return result;
+  }
+
+  if (result == -1 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    if (errno != EINTR) {
+      session->readable = 0;
+    }
+
+    return -1;
+  }
+
+  // End of stream or a socket error, srpc_iterate fails on 0
+  return 0;
+}
+
+// sendmsg is the socket flavour of writev, with SIGPIPE suppressed
+static _supla_int_t srpc_reactor_writev(const TsrpcIoVec *iov, int iov_count,
+                                        void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  struct iovec vec[2];
+  struct msghdr msg;
+  ssize_t result;
+  size_t size = 0;
+  int a;
+
+  if (!session->writable) {
+    return 0;
+  }
+
+  if (iov_count > 2) {
+    iov_count = 2;
+  }
+
+  for (a = 0; a < iov_count; a++) {
+    vec[a].iov_base = iov[a].data;
+    vec[a].iov_len = iov[a].size;
+    size += iov[a].size;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = vec;
+  msg.msg_iovlen = iov_count;
+
+  result = sendmsg(session->fd, &msg, MSG_NOSIGNAL);
+
+  if (result >= 0) {
+    // A short write means the socket buffer is full, EPOLLOUT follows
+    if ((size_t)result < size) {
+      session->writable = 0;
+    }
+
+    return result;
+  }
+
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    session->writable = 0;
+  } else if (errno != EINTR) {
+    supla_log(LOG_DEBUG, "srpc_reactor: fd %i write error %i", session->fd,
+              errno);
+    session->closing = 1;
+  }
+
+  return 0;
+}
+
+static void srpc_reactor_on_work_pending(void *_srpc, void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  srpc_reactor_ready_push(session->reactor, session);
+}
+
+// The caller's callbacks get back their own user_params
+
+static void srpc_reactor_on_remote_call_received(
+    void *_srpc, unsigned _supla_int_t rr_id, unsigned _supla_int_t call_type,
+    void *user_params, unsigned char proto_version) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.on_remote_call_received(
+      _srpc, rr_id, call_type, session->params.user_params, proto_version);
+}
+
+static void srpc_reactor_on_version_error(void *_srpc,
+                                          unsigned char remote_version,
+                                          void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.on_version_error(_srpc, remote_version,
+                                   session->params.user_params);
+}
+
+static void srpc_reactor_before_async_call(void *_srpc,
+                                           unsigned _supla_int_t call_type,
+                                           void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.before_async_call(_srpc, call_type,
+                                    session->params.user_params);
+}
+
+static void srpc_reactor_on_min_version_required(
+    void *_srpc, unsigned _supla_int_t call_type, unsigned char min_version,
+    void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.on_min_version_required(_srpc, call_type, min_version,
+                                          session->params.user_params);
+}
+
+static void srpc_reactor_on_out_writable(void *_srpc, void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.on_out_writable(_srpc, session->params.user_params);
+}
+
+static void srpc_reactor_on_out_dropped(void *_srpc, TSuplaDataPacket *sdp,
+                                        unsigned char lane,
+                                        void *user_params) {
+  TsrpcReactorSession *session = (TsrpcReactorSession *)user_params;
+  session->params.on_out_dropped(_srpc, sdp, lane, session->params.user_params);
+}
+
+void *srpc_reactor_init(_func_srpc_reactor_OnClose on_close) {
+  TsrpcReactor *reactor = (TsrpcReactor *)malloc(sizeof(TsrpcReactor));
+
+  if (reactor == NULL) {
+    return NULL;
+  }
+
+  memset(reactor, 0, sizeof(TsrpcReactor));
+  reactor->on_close = on_close;
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (reactor->epoll_fd == -1) {
+    free(reactor);
+    return NULL;
+  }
+
+  return reactor;
+}
+
+static void srpc_reactor_session_free(TsrpcReactor *reactor,
+                                      TsrpcReactorSession *session) {
+  if (reactor->on_close != NULL) {
+    reactor->on_close(reactor, session->srpc, session->fd,
+                      session->params.user_params);
+  }
+
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+  close(session->fd);
+  srpc_free(session->srpc);
+
+  if (session->prev != NULL) {
+    session->prev->next = session->next;
+  } else {
+    reactor->sessions = session->next;
+  }
+
+  if (session->next != NULL) {
+    session->next->prev = session->prev;
+  }
+
+  reactor->session_count--;
+  free(session);
+}
+
+void srpc_reactor_free(void *_reactor) {
+  TsrpcReactor *reactor = (TsrpcReactor *)_reactor;
+
+  if (reactor == NULL) {
+    return;
+  }
+
+  while (reactor->sessions != NULL) {
+    srpc_reactor_session_free(reactor, reactor->sessions);
+  }
+
+  while (reactor->watches != NULL) {
+    srpc_reactor_unwatch(reactor, reactor->watches->fd);
+  }
+
+  close(reactor->epoll_fd);
+  free(reactor);
+}
+
+void *srpc_reactor_add(void *_reactor, int fd, TsrpcParams *params) {
+  TsrpcReactor *reactor = (TsrpcReactor *)_reactor;
+  TsrpcReactorSession *session;
+  TsrpcParams srpc_params;
+  struct epoll_event event;
+  int flags;
+
+  if (fd < 0 || (flags = fcntl(fd, F_GETFL)) == -1 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return NULL;
+  }
+
+  session = (TsrpcReactorSession *)malloc(sizeof(TsrpcReactorSession));
+
+  if (session == NULL) {
+    return NULL;
+  }
+
+  memset(session, 0, sizeof(TsrpcReactorSession));
+  memcpy(&session->params, params, sizeof(TsrpcParams));
+  session->reactor = reactor;
+  session->fd = fd;
+  session->readable = 1;
+  session->writable = 1;
+
+  memcpy(&srpc_params, params, sizeof(TsrpcParams));
+  srpc_params.data_read = &srpc_reactor_read;
+  srpc_params.data_write = NULL;
+  srpc_params.data_writev = &srpc_reactor_writev;
+  srpc_params.on_work_pending = &srpc_reactor_on_work_pending;
+  srpc_params.eh = NULL;
+  srpc_params.user_params = session;
+
+  if (srpc_params.lock_policy == LCK_POLICY_DEFAULT) {
+    srpc_params.lock_policy = LCK_POLICY_NONE;
+  }
+
+  if (params->on_remote_call_received != NULL) {
+    srpc_params.on_remote_call_received =
+        &srpc_reactor_on_remote_call_received;
+  }
+
+  if (params->on_version_error != NULL) {
+    srpc_params.on_version_error = &srpc_reactor_on_version_error;
+  }
+
+  if (params->before_async_call != NULL) {
+    srpc_params.before_async_call = &srpc_reactor_before_async_call;
+  }
+
+  if (params->on_min_version_required != NULL) {
+    srpc_params.on_min_version_required = &srpc_reactor_on_min_version_required;
+  }
+
+  if (params->on_out_writable != NULL) {
+    srpc_params.on_out_writable = &srpc_reactor_on_out_writable;
+  }
+
+  if (params->on_out_dropped != NULL) {
+    srpc_params.on_out_dropped = &srpc_reactor_on_out_dropped;
+  }
+
+  session->srpc = srpc_init(&srpc_params);
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = session;
+
+  if (session->srpc == NULL ||
+      epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    if (session->srpc != NULL) {
+      srpc_free(session->srpc);
+    }
+
+    free(session);
+    return NULL;
+  }
+
+  session->next = reactor->sessions;
+
+  if (reactor->sessions != NULL) {
+    reactor->sessions->prev = session;
+  }
+
+  reactor->sessions = session;
+  reactor->session_count++;
+
+  srpc_reactor_ready_push(reactor, session);
+
+  return session->srpc;
+}
+
+void srpc_reactor_close(void *_reactor, void *_srpc) {
+  TsrpcReactorSession *session =
+      (TsrpcReactorSession *)srpc_get_user_params(_srpc);
+
+  session->closing = 1;
+  srpc_reactor_ready_push((TsrpcReactor *)_reactor, session);
+}
+
+unsigned int srpc_reactor_session_count(void *_reactor) {
+  return ((TsrpcReactor *)_reactor)->session_count;
+}
+
+char srpc_reactor_watch(void *_reactor, int fd,
+                        _func_srpc_reactor_OnFdReady on_ready,
+                        void *user_params) {
+  TsrpcReactor *reactor = (TsrpcReactor *)_reactor;
+  TsrpcReactorWatch *watch;
+  struct epoll_event event;
+
+  if (fd < 0 || on_ready == NULL) {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  watch = (TsrpcReactorWatch *)malloc(sizeof(TsrpcReactorWatch));
+
+  if (watch == NULL) {
+    return SUPLA_RESULT_FALSE;
+  }
+
+  watch->watch = 1;
+  watch->fd = fd;
+  watch->on_ready = on_ready;
+  watch->user_params = user_params;
+
+  // Level triggered, on_ready doesn't have to drain the fd
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = watch;
+
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    free(watch);
+    return SUPLA_RESULT_FALSE;
+  }
+
+  watch->next = reactor->watches;
+  reactor->watches = watch;
+
+  return SUPLA_RESULT_TRUE;
+}
+
+void srpc_reactor_unwatch(void *_reactor, int fd) {
+  TsrpcReactor *reactor = (TsrpcReactor *)_reactor;
+  TsrpcReactorWatch **watch = &reactor->watches;
+  TsrpcReactorWatch *found;
+
+  while (*watch != NULL && (*watch)->fd != fd) {
+    watch = &(*watch)->next;
+  }
+
+  if ((found = *watch) != NULL) {
+    *watch = found->next;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    free(found);
+  }
+}
+
+int srpc_reactor_run(void *_reactor, int timeout_ms) {
+  TsrpcReactor *reactor = (TsrpcReactor *)_reactor;
+  struct epoll_event events[SRPC_REACTOR_MAX_EVENTS];
+  TsrpcReactorSession *session, *last;
+  int a, count;
+  char done;
+
+  // Don't sleep while sessions still have work
+  count = epoll_wait(reactor->epoll_fd, events, SRPC_REACTOR_MAX_EVENTS,
+                     reactor->ready_head != NULL ? 0 : timeout_ms);
+
+  if (count == -1 && errno != EINTR) {
+    return -1;
+  }
+
+  for (a = 0; a < count; a++) {
+    if (*(unsigned char *)events[a].data.ptr) {
+      TsrpcReactorWatch *watch = (TsrpcReactorWatch *)events[a].data.ptr;
+      watch->on_ready(reactor, watch->fd, watch->user_params);
+      continue;
+    }
+
+    session = (TsrpcReactorSession *)events[a].data.ptr;
+
+    // Hangups and errors surface through read
+    if (events[a].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      session->readable = 1;
+    }
+
+    if (events[a].events & EPOLLOUT) {
+      session->writable = 1;
+    }
+
+    srpc_reactor_ready_push(reactor, session);
+  }
+
+  // Sessions made ready during this round wait for the next one
+  last = reactor->ready_tail;
+  count = 0;
+
+  do {
+    if ((session = srpc_reactor_ready_pop(reactor)) == NULL) {
+      break;
+    }
+
+    done = session == last;
+
+    if (!session->closing) {
+      count++;
+
+      if (srpc_iterate_batch(session->srpc, SRPC_REACTOR_BATCH) ==
+          SUPLA_RESULT_FALSE) {
+        session->closing = 1;
+      } else if (session->readable) {
+        // Not drained yet, epoll won't report it again
+        srpc_reactor_ready_push(reactor, session);
+      }
+    }
+
+    // A closing session still on the ready list is freed when it comes up
+    if (session->closing && !session->queued) {
+      srpc_reactor_session_free(reactor, session);
+    }
+  } while (!done);
+
+  return count;
+}
+
+#endif /*__linux__*/
@@ -0,0 +1,77 @@
+/*
+ Copyright (C) AC SOFTWARE SP. Z O.O.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef SRPC_REACTOR_H_
+#define SRPC_REACTOR_H_
+
+// Single threaded driver of many srpc sessions, one per socket (Linux only).
+// Sockets are watched with edge triggered epoll and a session is iterated
+// only when its socket is ready or srpc reports work left over. All srpc
+// calls on the sessions have to be made from the thread running
+// srpc_reactor_run, callbacks included.
+
+#ifdef __linux__
+
+#include "srpc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Called once per session, before its srpc is freed and its socket closed
+typedef void (*_func_srpc_reactor_OnClose)(void *reactor, void *_srpc, int fd,
+                                           void *user_params);
+
+void *srpc_reactor_init(_func_srpc_reactor_OnClose on_close);
+// Closes all sessions
+void srpc_reactor_free(void *reactor);
+
+// Takes over a connected socket, makes it non-blocking and creates its srpc
+// from params. data_read, data_write, data_writev and on_work_pending are
+// provided by the reactor, the other callbacks get params->user_params as
+// usual. Sessions are only touched from the reactor thread, so a lock_policy
+// left at LCK_POLICY_DEFAULT becomes LCK_POLICY_NONE. Returns the srpc or
+// NULL.
+void *srpc_reactor_add(void *reactor, int fd, TsrpcParams *params);
+// Closes the session once the current srpc_reactor_run round is over
+void srpc_reactor_close(void *reactor, void *_srpc);
+unsigned int srpc_reactor_session_count(void *reactor);
+
+// Called from srpc_reactor_run while a watched fd is readable
+typedef void (*_func_srpc_reactor_OnFdReady)(void *reactor, int fd,
+                                             void *user_params);
+
+// Watches a descriptor that is not a session, e.g. a listening socket or a
+// timerfd, from the same epoll. The fd stays owned by the caller. Watches
+// must not be removed from an on_ready callback.
+char srpc_reactor_watch(void *reactor, int fd,
+                        _func_srpc_reactor_OnFdReady on_ready,
+                        void *user_params);
+void srpc_reactor_unwatch(void *reactor, int fd);
+
+// Waits up to timeout_ms (-1 - no limit) for ready sockets and iterates the
+// sessions that have work. Returns the number of sessions iterated or -1.
+int srpc_reactor_run(void *reactor, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__linux__*/
+
+#endif /* SRPC_REACTOR_H_ */